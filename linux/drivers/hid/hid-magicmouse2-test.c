@@ -0,0 +1,299 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ *   KUnit tests for the Apple "Magic" Wireless Mouse driver
+ *
+ *   Included at the end of hid-magicmouse2.c when the module is built with
+ *   KUNIT=1, so that the tests can feed reports straight into the static
+ *   report handler. Each test gets a Magic Mouse 2 state with a registered
+ *   input device but no HID transport behind it.
+ */
+
+#include <kunit/test.h>
+
+struct magicmouse_test {
+	struct hid_device *hdev;
+	struct magicmouse_sc *msc;
+	struct input_dev *input;
+};
+
+static int magicmouse_test_init(struct kunit *test)
+{
+	static const struct hid_device_id id = {
+		HID_BLUETOOTH_DEVICE(BT_VENDOR_ID_APPLE,
+				     USB_DEVICE_ID_APPLE_MAGICMOUSE2),
+	};
+	struct magicmouse_test *priv;
+	struct input_dev *input;
+	int ret;
+
+	priv = kunit_kzalloc(test, sizeof(*priv), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, priv);
+	priv->hdev = kunit_kzalloc(test, sizeof(*priv->hdev), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, priv->hdev);
+	priv->msc = kunit_kzalloc(test, sizeof(*priv->msc), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, priv->msc);
+
+	priv->hdev->bus = BUS_BLUETOOTH;
+	priv->hdev->vendor = id.vendor;
+	priv->hdev->product = id.product;
+	magicmouse_init_state(priv->msc, priv->hdev);
+	KUNIT_ASSERT_EQ(test, magicmouse_init_config(priv->msc, &id), 0);
+	hid_set_drvdata(priv->hdev, priv->msc);
+
+	input = input_allocate_device();
+	KUNIT_ASSERT_NOT_NULL(test, input);
+	input->name = "Magic Mouse 2 KUnit";
+	input->id.bustype = BUS_BLUETOOTH;
+	input->id.vendor = id.vendor;
+	input->id.product = id.product;
+	priv->msc->input = input;
+
+	ret = magicmouse_setup_input(input, priv->hdev);
+	if (!ret)
+		ret = input_register_device(input);
+	if (ret) {
+		input_free_device(input);
+		kfree(priv->msc->curve);
+		KUNIT_FAIL(test, "unable to set up the input device (%d)", ret);
+		return ret;
+	}
+
+	priv->input = input;
+	test->priv = priv;
+	return 0;
+}
+
+static void magicmouse_test_exit(struct kunit *test)
+{
+	struct magicmouse_test *priv = test->priv;
+	struct magicmouse_sc *msc;
+
+	if (!priv)
+		return;
+
+	msc = priv->msc;
+	cancel_delayed_work_sync(&msc->work);
+	hrtimer_cancel(&msc->kinetic_timer);
+	hrtimer_cancel(&msc->coalesce_timer);
+	hrtimer_cancel(&msc->tap_timer);
+	hrtimer_cancel(&msc->predict_timer);
+	input_unregister_device(priv->input);
+	kfree(msc->curve);
+}
+
+/* Fill one touch record: a contact of size 10 in the middle of the
+ * surface, with the given touch major axis.
+ */
+static void magicmouse_test_touch(u8 *tdata, int id, int state, int major)
+{
+	tdata[3] = major;			/* touch major */
+	tdata[4] = 30;				/* touch minor */
+	tdata[5] = (id & 0x3) << 6 | 10;	/* size */
+	tdata[6] = 32 << 2 | (id >> 2 & 0x3);	/* orientation 0 */
+	tdata[7] = state;
+}
+
+/* Feed one Magic Mouse 2 report with no motion and, unless @state is
+ * negative, one small contact in the middle of the surface.
+ */
+static void magicmouse_test_report(struct magicmouse_test *priv, int id,
+		int state)
+{
+	u8 data[MOUSE2_HEADER_SIZE + MOUSE2_TOUCH_SIZE] = { MOUSE2_REPORT_ID };
+
+	magicmouse_test_touch(data + MOUSE2_HEADER_SIZE, id, state, 40);
+	magicmouse_raw_event(priv->hdev, NULL, data,
+			     state < 0 ? MOUSE2_HEADER_SIZE : sizeof(data));
+}
+
+static int magicmouse_test_active_slots(struct input_dev *input)
+{
+	struct input_mt *mt = input->mt;
+	int ii, active = 0;
+
+	for (ii = 0; ii < mt->num_slots; ii++)
+		if (input_mt_is_active(&mt->slots[ii]))
+			active++;
+
+	return active;
+}
+
+/* A mouse has fewer slots than tracking IDs, so every new contact must be
+ * able to take a slot freed by an earlier, lifted one.
+ */
+static void magicmouse_test_mouse_slot_reuse(struct kunit *test)
+{
+	struct magicmouse_test *priv = test->priv;
+	int ii, id;
+
+	KUNIT_ASSERT_EQ(test, priv->input->mt->num_slots, MOUSE_MT_SLOTS);
+
+	for (ii = 0; ii < 3 * MOUSE_MT_SLOTS; ii++) {
+		id = ii % MAX_TOUCHES;
+
+		magicmouse_test_report(priv, id, TOUCH_STATE_START);
+		KUNIT_EXPECT_TRUE_MSG(test, priv->msc->touches[id].mt_down,
+				      "touch %d got no slot", ii);
+		KUNIT_EXPECT_EQ(test, magicmouse_test_active_slots(priv->input), 1);
+
+		magicmouse_test_report(priv, id, TOUCH_STATE_DRAG);
+		KUNIT_EXPECT_EQ(test, magicmouse_test_active_slots(priv->input), 1);
+
+		magicmouse_test_report(priv, id, TOUCH_STATE_NONE);
+		KUNIT_EXPECT_FALSE(test, priv->msc->touches[id].mt_down);
+		KUNIT_EXPECT_EQ(test, magicmouse_test_active_slots(priv->input), 0);
+	}
+}
+
+/* Motion arrives before multitouch is enabled; only touch data proves the
+ * enable took effect.
+ */
+static void magicmouse_test_mt_active(struct kunit *test)
+{
+	struct magicmouse_test *priv = test->priv;
+
+	magicmouse_test_report(priv, 0, -1);
+	KUNIT_EXPECT_FALSE(test, READ_ONCE(priv->msc->mt_active));
+
+	magicmouse_test_report(priv, 0, TOUCH_STATE_START);
+	KUNIT_EXPECT_TRUE(test, READ_ONCE(priv->msc->mt_active));
+}
+
+/* A palm ahead of a finger in the report must not take the finger's place
+ * in the touches that click and scroll handling look at.
+ */
+static void magicmouse_test_palm_first(struct kunit *test)
+{
+	struct magicmouse_test *priv = test->priv;
+	struct magicmouse_sc *msc = priv->msc;
+	u8 data[MOUSE2_HEADER_SIZE + 2 * MOUSE2_TOUCH_SIZE] = { MOUSE2_REPORT_ID };
+
+	magicmouse_test_touch(data + MOUSE2_HEADER_SIZE, 1, TOUCH_STATE_START,
+			      msc->cfg.palm_major);
+	magicmouse_test_touch(data + MOUSE2_HEADER_SIZE + MOUSE2_TOUCH_SIZE, 2,
+			      TOUCH_STATE_START, 40);
+	magicmouse_raw_event(priv->hdev, NULL, data, sizeof(data));
+
+	KUNIT_EXPECT_EQ(test, msc->touches[1].contact, CONTACT_PALM);
+	KUNIT_EXPECT_EQ(test, msc->ntouches, 1);
+	KUNIT_EXPECT_EQ(test, msc->tracking_ids[0], 2);
+	KUNIT_EXPECT_EQ(test, magicmouse_firm_touch(msc), 2);
+}
+
+/* Replayed pointer traces for the prediction test. The device samples
+ * the hand every interval and the report arrives one interval later,
+ * except in the burst trace, where every other report is held back and
+ * arrives just before the next one.
+ */
+#define MAGICMOUSE_TEST_INTERVAL_US	11250
+#define MAGICMOUSE_TEST_REPORTS		60
+
+enum {
+	MAGICMOUSE_TEST_STEADY,		/* 4 units/ms throughout */
+	MAGICMOUSE_TEST_STOP,		/* speed up, hold 6 units/ms, stop */
+	MAGICMOUSE_TEST_BURST,		/* steady, delivered in pairs */
+	MAGICMOUSE_TEST_TRACES,
+};
+
+static const char * const magicmouse_test_trace_names[] = {
+	"steady", "stop", "burst",
+};
+
+/* Hand position in units at @t_us. */
+static s64 magicmouse_test_hand(int trace, s64 t_us)
+{
+	if (t_us < 0)
+		return 0;
+	if (trace != MAGICMOUSE_TEST_STOP)
+		return div_s64(4 * t_us, 1000);
+
+	if (t_us < 200000)
+		return div64_s64(6 * t_us * t_us, 200000LL * 2 * 1000);
+	if (t_us < 400000)
+		return 600 + div_s64(6 * (t_us - 200000), 1000);
+	return 1800;
+}
+
+/* Replay @trace through the prediction and return how far the pointer
+ * trails the hand when each report arrives, as the time the hand needs to
+ * cover that distance. @pointer is set to where the pointer ends up.
+ */
+static s64 magicmouse_test_replay(struct magicmouse_sc *msc, int trace,
+		bool predict, s64 *pointer)
+{
+	s64 sampled, arrival, last_arrival = -PREDICT_GAP_US - 1;
+	s64 last_hand = 0, behind = 0, travel = 0;
+	int ii, x, y;
+
+	msc->cfg.pointer_predict = predict;
+	msc->predict_x = 0;
+	msc->predict_y = 0;
+	msc->predict_vx = 0;
+	msc->predict_vy = 0;
+	*pointer = 0;
+
+	for (ii = 0; ii < MAGICMOUSE_TEST_REPORTS; ii++) {
+		sampled = (s64)ii * MAGICMOUSE_TEST_INTERVAL_US;
+		arrival = sampled + MAGICMOUSE_TEST_INTERVAL_US;
+		if (trace == MAGICMOUSE_TEST_BURST && !(ii & 1))
+			arrival += MAGICMOUSE_TEST_INTERVAL_US - 500;
+
+		x = magicmouse_test_hand(trace, sampled) - last_hand;
+		y = 0;
+		last_hand += x;
+		magicmouse_predict_step(msc, &x, &y, arrival - last_arrival);
+		last_arrival = arrival;
+		*pointer += x;
+
+		if (!ii)
+			continue;
+		behind += abs(magicmouse_test_hand(trace, arrival) - *pointer);
+		travel += magicmouse_test_hand(trace, arrival) -
+			  magicmouse_test_hand(trace, arrival - 1000);
+	}
+
+	return travel ? div64_s64(behind * 1000, travel) : 0;
+}
+
+/* Prediction should win back most of the one interval the reports lag
+ * behind, and still leave the pointer where the hand stopped.
+ */
+static void magicmouse_test_predict_latency(struct kunit *test)
+{
+	struct magicmouse_test *priv = test->priv;
+	struct magicmouse_sc *msc = priv->msc;
+	s64 plain, predicted, pointer;
+	int trace;
+
+	for (trace = 0; trace < MAGICMOUSE_TEST_TRACES; trace++) {
+		plain = magicmouse_test_replay(msc, trace, false, &pointer);
+		predicted = magicmouse_test_replay(msc, trace, true, &pointer);
+		kunit_info(test, "%s: %lld us behind, %lld us with prediction\n",
+			   magicmouse_test_trace_names[trace], plain, predicted);
+		KUNIT_EXPECT_LT(test, predicted + MAGICMOUSE_TEST_INTERVAL_US / 2,
+				plain);
+
+		if (trace == MAGICMOUSE_TEST_STOP) {
+			KUNIT_EXPECT_EQ(test, msc->predict_x, 0);
+			KUNIT_EXPECT_EQ(test, pointer,
+				magicmouse_test_hand(trace, S64_MAX));
+		}
+	}
+}
+
+static struct kunit_case magicmouse_test_cases[] = {
+	KUNIT_CASE(magicmouse_test_mouse_slot_reuse),
+	KUNIT_CASE(magicmouse_test_mt_active),
+	KUNIT_CASE(magicmouse_test_palm_first),
+	KUNIT_CASE(magicmouse_test_predict_latency),
+	{}
+};
+
+static struct kunit_suite magicmouse_test_suite = {
+	.name = "hid-magicmouse2",
+	.init = magicmouse_test_init,
+	.exit = magicmouse_test_exit,
+	.test_cases = magicmouse_test_cases,
+};
+
+kunit_test_suite(magicmouse_test_suite);
@@ -16,35 +16,57 @@
 
 #define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
 
+#include <linux/bitmap.h>
+#include <linux/ctype.h>
+#include <linux/debugfs.h>
 #include <linux/device.h>
 #include <linux/hid.h>
+#include <linux/hrtimer.h>
+#include <linux/kthread.h>
 #include <linux/input/mt.h>
+#include <linux/kref.h>
+#include <linux/miscdevice.h>
+#include <linux/mm.h>
 #include <linux/module.h>
+#include <linux/poll.h>
+#include <linux/power_supply.h>
 #include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/vmalloc.h>
+#include <linux/wait.h>
 #include <linux/workqueue.h>
 #include <linux/kernel.h>
 
 #include "hid-ids.h"
+#include "hid-magicmouse2.h"
 
 static bool emulate_3button = true;
-module_param(emulate_3button, bool, 0644);
+module_param(emulate_3button, bool, 0444);
 MODULE_PARM_DESC(emulate_3button, "Emulate a middle button");
 
 static bool middle_click_3finger = false;
-module_param(middle_click_3finger, bool, 0644);
+module_param(middle_click_3finger, bool, 0444);
 MODULE_PARM_DESC(middle_click_3finger, "Use 3 finger click to emulate middle button");
 
-static int middle_button_start = -250;
-static int middle_button_stop = +750;
+static const int middle_button_start = -250;
+static const int middle_button_stop = +750;
 
 static bool emulate_scroll_wheel = true;
-module_param(emulate_scroll_wheel, bool, 0644);
+module_param(emulate_scroll_wheel, bool, 0444);
 MODULE_PARM_DESC(emulate_scroll_wheel, "Emulate a scroll wheel");
 
 static bool stop_scroll_while_moving = false;
-module_param(stop_scroll_while_moving, bool, 0644);
+module_param(stop_scroll_while_moving, bool, 0444);
 MODULE_PARM_DESC(stop_scroll_while_moving, "Stop scrolling whenever the mouse moves");
 
+static unsigned int stop_scroll_threshold = 16;
+module_param(stop_scroll_threshold, uint, 0444);
+MODULE_PARM_DESC(stop_scroll_threshold, "Mouse motion over the last few reports that counts as moving");
+
+static unsigned int stop_scroll_holdoff_ms = 250;
+module_param(stop_scroll_holdoff_ms, uint, 0444);
+MODULE_PARM_DESC(stop_scroll_holdoff_ms, "Time in ms scrolling stays disabled after the mouse moved");
+
 static unsigned int scroll_speed = 0;
 static int param_set_scroll_speed(const char *val,
 				  const struct kernel_param *kp) {
@@ -54,7 +76,7 @@ static int param_set_scroll_speed(const char *val,
 	scroll_speed = speed;
 	return 0;
 }
-module_param_call(scroll_speed, param_set_scroll_speed, param_get_uint, &scroll_speed, 0644);
+module_param_call(scroll_speed, param_set_scroll_speed, param_get_uint, &scroll_speed, 0444);
 MODULE_PARM_DESC(scroll_speed, "Scroll speed, value from 0 (slow) to 63 (fast)");
 
 static unsigned int scroll_delay_pos_x = 200;
@@ -66,7 +88,7 @@ static int param_set_scroll_delay_pos_x(const char *val,
 	scroll_delay_pos_x = delay;
 	return 0;
 }
-module_param_call(scroll_delay_pos_x, param_set_scroll_delay_pos_x, param_get_uint, &scroll_delay_pos_x, 0644);
+module_param_call(scroll_delay_pos_x, param_set_scroll_delay_pos_x, param_get_uint, &scroll_delay_pos_x, 0444);
 MODULE_PARM_DESC(scroll_delay_pos_x, "Scroll X position delay before start scrolling");
 
 static unsigned int scroll_delay_pos_y = 200;
@@ -78,75 +100,500 @@ static int param_set_scroll_delay_pos_y(const char *val,
 	scroll_delay_pos_y = delay;
 	return 0;
 }
-module_param_call(scroll_delay_pos_y, param_set_scroll_delay_pos_y, param_get_uint, &scroll_delay_pos_y, 0644);
+module_param_call(scroll_delay_pos_y, param_set_scroll_delay_pos_y, param_get_uint, &scroll_delay_pos_y, 0444);
 MODULE_PARM_DESC(scroll_delay_pos_y, "Scroll Y position delay before start scrolling");
 
 static bool scroll_acceleration = true;
-module_param(scroll_acceleration, bool, 0644);
+module_param(scroll_acceleration, bool, 0444);
 MODULE_PARM_DESC(scroll_acceleration, "Accelerate sequential scroll events");
 
+/* Scroll acceleration curve: finger velocity in units per ms mapped to a
+ * scroll gain. The user supplied points are expanded into one gain per
+ * unit/ms, in 1/SCROLL_GAIN_ONE fixed point, so the hot path is a single
+ * lookup and a linear interpolation.
+ */
+#define SCROLL_GAIN_SHIFT 8
+#define SCROLL_GAIN_ONE (1 << SCROLL_GAIN_SHIFT)
+#define SCROLL_CURVE_POINTS 16
+#define SCROLL_CURVE_MAX_VEL 64 /* units per ms */
+#define SCROLL_CURVE_MAX_GAIN 1000 /* percent */
+
+struct magicmouse_curve {
+	int npoints;
+	unsigned int vel[SCROLL_CURVE_POINTS];
+	unsigned int gain[SCROLL_CURVE_POINTS];
+	u16 table[SCROLL_CURVE_MAX_VEL + 1];
+};
+
+static struct magicmouse_curve *scroll_curve;
+
+static void magicmouse_curve_expand(struct magicmouse_curve *curve)
+{
+	int v, p = 0;
+
+	for (v = 0; v <= SCROLL_CURVE_MAX_VEL; v++) {
+		unsigned int gain;
+
+		while (p < curve->npoints - 1 && v > curve->vel[p + 1])
+			p++;
+
+		if (v <= curve->vel[0])
+			gain = curve->gain[0];
+		else if (p == curve->npoints - 1)
+			gain = curve->gain[p];
+		else
+			gain = curve->gain[p] +
+				((int)curve->gain[p + 1] - (int)curve->gain[p]) *
+				(int)(v - curve->vel[p]) /
+				(int)(curve->vel[p + 1] - curve->vel[p]);
+
+		curve->table[v] = gain * SCROLL_GAIN_ONE / 100;
+	}
+}
+
+/* Parse "velocity:gain" pairs, gain in percent, with strictly increasing
+ * velocities, e.g. "0:100,10:150,30:400". An empty string yields no curve.
+ */
+static int magicmouse_curve_parse(const char *val,
+		struct magicmouse_curve **out)
+{
+	struct magicmouse_curve *curve = NULL;
+	char *buf, *cur, *tok;
+	int ret = 0;
+
+	buf = kstrdup(val, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	cur = strim(buf);
+	if (*cur) {
+		curve = kzalloc(sizeof(*curve), GFP_KERNEL);
+		if (!curve) {
+			ret = -ENOMEM;
+			goto out;
+		}
+
+		while ((tok = strsep(&cur, ",")) != NULL) {
+			unsigned int vel, gain;
+
+			if (curve->npoints == SCROLL_CURVE_POINTS ||
+			    sscanf(tok, "%u:%u", &vel, &gain) != 2 ||
+			    vel > SCROLL_CURVE_MAX_VEL || gain < 1 ||
+			    gain > SCROLL_CURVE_MAX_GAIN ||
+			    (curve->npoints &&
+			     vel <= curve->vel[curve->npoints - 1])) {
+				ret = -EINVAL;
+				goto out;
+			}
+			curve->vel[curve->npoints] = vel;
+			curve->gain[curve->npoints] = gain;
+			curve->npoints++;
+		}
+		magicmouse_curve_expand(curve);
+	}
+
+	*out = curve;
+	curve = NULL;
+out:
+	kfree(curve);
+	kfree(buf);
+	return ret;
+}
+
+static int magicmouse_curve_format(const struct magicmouse_curve *curve,
+		char *buf)
+{
+	int ii, len = 0;
+
+	for (ii = 0; curve && ii < curve->npoints; ii++)
+		len += scnprintf(buf + len, PAGE_SIZE - len, "%s%u:%u",
+				 ii ? "," : "", curve->vel[ii], curve->gain[ii]);
+	len += scnprintf(buf + len, PAGE_SIZE - len, "\n");
+
+	return len;
+}
+
+static int param_set_scroll_accel_curve(const char *val,
+				  const struct kernel_param *kp) {
+	struct magicmouse_curve *curve;
+	int ret;
+
+	if (!val)
+		return -EINVAL;
+
+	ret = magicmouse_curve_parse(val, &curve);
+	if (ret)
+		return ret;
+
+	/* Only set at load time, before any device is probed. */
+	kfree(scroll_curve);
+	scroll_curve = curve;
+	return 0;
+}
+
+static int param_get_scroll_accel_curve(char *buffer,
+				  const struct kernel_param *kp) {
+	return magicmouse_curve_format(scroll_curve, buffer);
+}
+module_param_call(scroll_accel_curve, param_set_scroll_accel_curve, param_get_scroll_accel_curve, NULL, 0444);
+MODULE_PARM_DESC(scroll_accel_curve, "Default scroll gain curve as velocity:gain pairs, velocity in units/ms, gain in percent (empty to disable)");
+
+static bool scroll_kinetic = false;
+module_param(scroll_kinetic, bool, 0444);
+MODULE_PARM_DESC(scroll_kinetic, "Keep scrolling with decaying speed after the finger lifts");
+
+static unsigned int scroll_kinetic_decay = 8;
+static int param_set_scroll_kinetic_decay(const char *val,
+				  const struct kernel_param *kp) {
+	unsigned long decay;
+	if (!val || kstrtoul(val, 0, &decay) || decay < 1 || decay > 99)
+		return -EINVAL;
+	scroll_kinetic_decay = decay;
+	return 0;
+}
+module_param_call(scroll_kinetic_decay, param_set_scroll_kinetic_decay, param_get_uint, &scroll_kinetic_decay, 0444);
+MODULE_PARM_DESC(scroll_kinetic_decay, "Percentage of kinetic scroll speed lost every tick, value from 1 (long) to 99 (short)");
+
+static unsigned int scroll_coalesce_us = 0;
+static int param_set_scroll_coalesce_us(const char *val,
+				  const struct kernel_param *kp) {
+	unsigned long window;
+	if (!val || kstrtoul(val, 0, &window) || window > 100000)
+		return -EINVAL;
+	scroll_coalesce_us = window;
+	return 0;
+}
+module_param_call(scroll_coalesce_us, param_set_scroll_coalesce_us, param_get_uint, &scroll_coalesce_us, 0444);
+MODULE_PARM_DESC(scroll_coalesce_us, "Merge scroll events within this window in microseconds, 0 (off) to 100000");
+
+static bool swipe_navigation = false;
+module_param(swipe_navigation, bool, 0444);
+MODULE_PARM_DESC(swipe_navigation, "Horizontal swipes on the Magic Mouse send back/forward keys");
+
+static unsigned int swipe_distance = 600;
+module_param(swipe_distance, uint, 0444);
+MODULE_PARM_DESC(swipe_distance, "Horizontal distance in units a finger must travel to swipe");
+
+static unsigned int swipe_time_ms = 300;
+module_param(swipe_time_ms, uint, 0444);
+MODULE_PARM_DESC(swipe_time_ms, "Time in ms from touch start within which a swipe must complete");
+
+static bool tap_to_click = false;
+module_param(tap_to_click, bool, 0444);
+MODULE_PARM_DESC(tap_to_click, "Tap the Magic Mouse surface to click, with 1, 2 or 3 fingers for left, right or middle");
+
+static unsigned int tap_time_ms = 180;
+module_param(tap_time_ms, uint, 0444);
+MODULE_PARM_DESC(tap_time_ms, "Maximum time in ms a finger may rest on the surface for a tap");
+
+static unsigned int tap_double_ms = 200;
+module_param(tap_double_ms, uint, 0444);
+MODULE_PARM_DESC(tap_double_ms, "Time in ms after a tap in which a new touch continues it as a double tap or drag");
+
+static unsigned int tap_travel = 100;
+module_param(tap_travel, uint, 0444);
+MODULE_PARM_DESC(tap_travel, "Maximum distance in units a finger may move during a tap");
+
+static bool pointer_predict = false;
+module_param(pointer_predict, bool, 0444);
+MODULE_PARM_DESC(pointer_predict, "Lead Magic Mouse 2 pointer motion by its estimated velocity to hide report latency");
+
+static unsigned int pointer_predict_us = 11000;
+static int param_set_pointer_predict_us(const char *val,
+				  const struct kernel_param *kp) {
+	unsigned long horizon;
+	if (!val || kstrtoul(val, 0, &horizon) || horizon > 50000)
+		return -EINVAL;
+	pointer_predict_us = horizon;
+	return 0;
+}
+module_param_call(pointer_predict_us, param_set_pointer_predict_us, param_get_uint, &pointer_predict_us, 0444);
+MODULE_PARM_DESC(pointer_predict_us, "How far ahead pointer motion is predicted in microseconds, 0 to 50000");
+
+static unsigned int pointer_predict_damping = 50;
+static int param_set_pointer_predict_damping(const char *val,
+				  const struct kernel_param *kp) {
+	unsigned long damping;
+	if (!val || kstrtoul(val, 0, &damping) || damping > 95)
+		return -EINVAL;
+	pointer_predict_damping = damping;
+	return 0;
+}
+module_param_call(pointer_predict_damping, param_set_pointer_predict_damping, param_get_uint, &pointer_predict_damping, 0444);
+MODULE_PARM_DESC(pointer_predict_damping, "Percentage of the previous velocity estimate kept on every report, value from 0 (fast) to 95 (smooth)");
+
+static unsigned int jitter_threshold = 0;
+static int param_set_jitter_threshold(const char *val,
+				  const struct kernel_param *kp) {
+	unsigned long threshold;
+	if (!val || kstrtoul(val, 0, &threshold) || threshold > 64)
+		return -EINVAL;
+	jitter_threshold = threshold;
+	return 0;
+}
+module_param_call(jitter_threshold, param_set_jitter_threshold, param_get_uint, &jitter_threshold, 0444);
+MODULE_PARM_DESC(jitter_threshold, "Contact movement in units that is ignored as jitter, 0 (off) to 64");
+
+static unsigned int jitter_smoothing = 50;
+static int param_set_jitter_smoothing(const char *val,
+				  const struct kernel_param *kp) {
+	unsigned long smoothing;
+	if (!val || kstrtoul(val, 0, &smoothing) || smoothing > 90)
+		return -EINVAL;
+	jitter_smoothing = smoothing;
+	return 0;
+}
+module_param_call(jitter_smoothing, param_set_jitter_smoothing, param_get_uint, &jitter_smoothing, 0444);
+MODULE_PARM_DESC(jitter_smoothing, "Percentage of the previous contact position kept for movement just past jitter_threshold, value from 0 to 90");
+
+static bool threaded = false;
+module_param(threaded, bool, 0444);
+MODULE_PARM_DESC(threaded, "Decode reports in a per-device thread instead of the transport receive path");
+
+static int threaded_nice = -10;
+module_param(threaded_nice, int, 0444);
+MODULE_PARM_DESC(threaded_nice, "Nice value of the per-device report thread, from -20 to 19; the thread never runs at real-time priority");
+
+static bool frame_ring = false;
+module_param(frame_ring, bool, 0444);
+MODULE_PARM_DESC(frame_ring, "Expose decoded touch frames through an mmap-able character device per device");
+
+static unsigned int battery_interval_s = 60;
+static int param_set_battery_interval_s(const char *val,
+				  const struct kernel_param *kp) {
+	unsigned long interval;
+	if (!val || kstrtoul(val, 0, &interval) || interval < 10 ||
+	    interval > 3600)
+		return -EINVAL;
+	battery_interval_s = interval;
+	return 0;
+}
+module_param_call(battery_interval_s, param_set_battery_interval_s, param_get_uint, &battery_interval_s, 0444);
+MODULE_PARM_DESC(battery_interval_s, "Minimum time in seconds between battery queries, from 10 to 3600");
+
 static bool report_undeciphered;
-module_param(report_undeciphered, bool, 0644);
+module_param(report_undeciphered, bool, 0444);
 MODULE_PARM_DESC(report_undeciphered, "Report undeciphered multi-touch state field using a MSC_RAW event");
 
-#define TRACKPAD_REPORT_ID 0x28
-#define TRACKPAD2_USB_REPORT_ID 0x02
-#define TRACKPAD2_BT_REPORT_ID 0x31
-#define MOUSE_REPORT_ID    0x29
-#define MOUSE2_REPORT_ID   0x12
-#define MOUSE2_REQUEST_REPORT_ID   0xa1
-#define DOUBLE_REPORT_ID   0xf7
-/* These definitions are not precise, but they're close enough.  (Bits
- * 0x03 seem to indicate the aspect ratio of the touch, bits 0x70 seem
- * to be some kind of bit mask -- 0x20 may be a near-field reading,
- * and 0x40 is actual contact, and 0x10 may be a start/stop or change
- * indication.)
- */
-#define TOUCH_STATE_MASK  0xf0
-#define TOUCH_STATE_NONE  0x00
-#define TOUCH_STATE_START 0x30
-#define TOUCH_STATE_DRAG  0x40
+static struct workqueue_struct *magicmouse_wq;
+static struct dentry *magicmouse_debugfs;
 
 /* Number of high-resolution events for each low-resolution detent. */
+#define SCROLL_HR_UNITS 120 /* hi-res units per detent */
 #define SCROLL_HR_STEPS 10
-#define SCROLL_HR_MULT (120 / SCROLL_HR_STEPS)
-#define SCROLL_HR_THRESHOLD 90 /* units */
+#define SCROLL_HR_MULT (SCROLL_HR_UNITS / SCROLL_HR_STEPS)
 #define SCROLL_ACCEL_DEFAULT 1
 
-/* Touch surface information. Dimension is in hundredths of a mm, min and max
- * are in units. */
-#define MOUSE_DIMENSION_X (float)9056
-#define MOUSE_MIN_X -1100
-#define MOUSE_MAX_X 1258
-#define MOUSE_RES_X ((MOUSE_MAX_X - MOUSE_MIN_X) / (MOUSE_DIMENSION_X / 100))
-#define MOUSE_DIMENSION_Y (float)5152
-#define MOUSE_MIN_Y -1589
-#define MOUSE_MAX_Y 2047
-#define MOUSE_RES_Y ((MOUSE_MAX_Y - MOUSE_MIN_Y) / (MOUSE_DIMENSION_Y / 100))
-
-#define TRACKPAD_DIMENSION_X (float)13000
-#define TRACKPAD_MIN_X -2909
-#define TRACKPAD_MAX_X 3167
-#define TRACKPAD_RES_X \
-	((TRACKPAD_MAX_X - TRACKPAD_MIN_X) / (TRACKPAD_DIMENSION_X / 100))
-#define TRACKPAD_DIMENSION_Y (float)11000
-#define TRACKPAD_MIN_Y -2456
-#define TRACKPAD_MAX_Y 2565
-#define TRACKPAD_RES_Y \
-	((TRACKPAD_MAX_Y - TRACKPAD_MIN_Y) / (TRACKPAD_DIMENSION_Y / 100))
-
-#define TRACKPAD2_DIMENSION_X (float)16000
-#define TRACKPAD2_MIN_X -3678
-#define TRACKPAD2_MAX_X 3934
-#define TRACKPAD2_RES_X \
-	((TRACKPAD2_MAX_X - TRACKPAD2_MIN_X) / (TRACKPAD2_DIMENSION_X / 100))
-#define TRACKPAD2_DIMENSION_Y (float)11490
-#define TRACKPAD2_MIN_Y -2478
-#define TRACKPAD2_MAX_Y 2587
-#define TRACKPAD2_RES_Y \
-	((TRACKPAD2_MAX_Y - TRACKPAD2_MIN_Y) / (TRACKPAD2_DIMENSION_Y / 100))
-
-#define MAX_TOUCHES		16
+/* Kinetic scrolling. Velocities are in high-resolution wheel units per
+ * second. The timer slack lets coasting share wakeups with other timers.
+ */
+#define SCROLL_KINETIC_TICK_US 16000
+#define SCROLL_KINETIC_SLACK_US 4000
+#define SCROLL_KINETIC_START 600
+#define SCROLL_KINETIC_STOP 60
+#define SCROLL_KINETIC_MAX 24000
+
+/* Pointer prediction: velocity in units per ms in Q8 fixed point. Reports
+ * further apart than the gap restart the estimate, and without a report
+ * for the idle time the prediction is taken back.
+ */
+#define PREDICT_VEL_SHIFT	8
+#define PREDICT_VEL_MAX		(4096 << PREDICT_VEL_SHIFT)
+#define PREDICT_GAP_US		50000
+#define PREDICT_IDLE_US		25000
+#define PREDICT_MAX_OFFSET	64
+
+/* Contact movement beyond this many times the jitter threshold is
+ * reported unfiltered, which bounds the lag the filter adds.
+ */
+#define JITTER_SNAP		4
+
+#define MAX_TOUCHES		16	/* tracking IDs are four bits */
+
+/* Contact classes, ordered so that a touch can only be upgraded towards
+ * palm during its lifetime.
+ */
+enum magicmouse_contact {
+	CONTACT_FINGER,
+	CONTACT_THUMB,	/* no scrolling or button selection, still reported */
+	CONTACT_PALM,	/* ignored entirely */
+};
+
+/* Q4 fixed point, i.e. 16 is a ratio of 1.0. */
+#define THUMB_RATIO_ONE		16
+
+/* Report ring for threaded mode. The largest report is a trackpad report
+ * with twelve bytes of prefix and fifteen touches of nine bytes; double
+ * reports carry two of the smaller Bluetooth ones.
+ */
+#define REPORT_RING_SIZE	32	/* power of two */
+#define REPORT_MAX_SIZE		160
+
+struct magicmouse_report_slot {
+	int size;
+	ktime_t queued;
+	u8 data[REPORT_MAX_SIZE];
+};
+
+/**
+ * struct magicmouse_ring - Single-producer/single-consumer report ring.
+ * @head: Next slot written by raw_event, published with release order.
+ * @tail: Next slot read by the report thread, published with release order.
+ * @dropped: Reports dropped because the thread fell behind.
+ * @handled: Reports decoded by the report thread.
+ * @delay_sum_ns: Total time reports waited in the ring.
+ * @delay_max_ns: Longest time a report waited in the ring.
+ * @slot: Report copies.
+ *
+ * The wait in the ring is all the latency threaded mode adds over
+ * decoding in raw_event; it is shown in debugfs as thread_delay.
+ */
+struct magicmouse_ring {
+	unsigned int head;
+	unsigned int tail;
+	unsigned long dropped;
+	unsigned long handled;
+	u64 delay_sum_ns;
+	u64 delay_max_ns;
+	struct magicmouse_report_slot slot[REPORT_RING_SIZE];
+};
+
+/* Decoded frame ring, see struct magicmouse_frame_ring. At 90 reports a
+ * second this holds a little under a second of frames.
+ */
+#define FRAME_RING_SIZE		64	/* power of two */
+
+/**
+ * struct magicmouse_frames - Character device exposing the frame ring.
+ * @ref: Held by the driver and by every open file.
+ * @misc: The character device.
+ * @wait: Woken when a frame is written or the device goes away.
+ * @dead: Set once the device was removed.
+ * @ring: Frame ring shared with userspace, from vmalloc_user().
+ * @ring_size: Size of @ring in bytes, a multiple of PAGE_SIZE.
+ * @name: Name of @misc.
+ */
+struct magicmouse_frames {
+	struct kref ref;
+	struct miscdevice misc;
+	wait_queue_head_t wait;
+	bool dead;
+	struct magicmouse_frame_ring *ring;
+	size_t ring_size;
+	char name[48];
+};
+
+/**
+ * struct magicmouse_frames_reader - Open file of a frame ring device.
+ * @frames: The frame ring device.
+ * @seen: Ring head at the last poll() that reported new frames.
+ */
+struct magicmouse_frames_reader {
+	struct magicmouse_frames *frames;
+	u32 seen;
+};
+
+/* Touch zone map: a coarse grid over the touch surface, each cell holding
+ * the buttons a click there produces (same bits as clicks) and flags.
+ * Without a loaded map the middle_button_start/stop intervals apply.
+ */
+#define ZONE_COLS		8
+#define ZONE_ROWS		8
+#define ZONE_CLICK_MASK		0x07
+#define ZONE_NO_SCROLL		0x08
+#define ZONE_IGNORE		0x10
+
+/* Tap recognizer states. */
+enum magicmouse_tap_state {
+	TAP_IDLE,	/* no fingers, nothing pending */
+	TAP_TOUCH,	/* fingers down that may still become a tap */
+	TAP_INVALID,	/* fingers down that can no longer be a tap */
+	TAP_RELEASED,	/* tap button pressed, waiting for a follow-up */
+	TAP_DRAG,	/* tap and drag, button held until lift */
+};
+
+/* Multitouch enable retries after the device rejected the feature report:
+ * the delay starts short and doubles up to a cap, for a bounded number of
+ * attempts.
+ */
+#define MT_ENABLE_DELAY_MS	20
+#define MT_ENABLE_DELAY_MAX_MS	1000
+#define MT_ENABLE_ATTEMPTS	10
+#define MT_FEATURE_MAX_SIZE	3
+
+/* Milestones of bringing a device up, timed from the start of probe. */
+enum magicmouse_phase {
+	PHASE_PARSE,		/* report descriptor parsed */
+	PHASE_HW_START,		/* transport started, input registered */
+	PHASE_REPORT,		/* touch report registered */
+	PHASE_PROBE,		/* probe returned, pointer usable */
+	PHASE_MT_ENABLE,	/* device accepted the multitouch request */
+	PHASE_FIRST_TOUCH,	/* first touch decoded */
+	PHASE_COUNT,
+};
+
+static const char * const magicmouse_phase_names[PHASE_COUNT] = {
+	"parse", "hw_start", "report", "probe", "mt_enable", "first_touch",
+};
+
+/* Number of mouse reports over which pointer motion is summed, and the
+ * report gap after which older motion no longer counts.
+ */
+#define MOTION_WINDOW		4
+#define MOTION_WINDOW_GAP	(HZ / 20)
+
+/**
+ * struct magicmouse_config - Per-device tunables.
+ *
+ * Copied from the module parameters when a device is bound, so changing a
+ * parameter only affects devices bound afterwards. Every field can be
+ * changed per device in sysfs; a mouse advertises the middle button, keys
+ * and wheel of the emulations even while they are switched off.
+ *
+ * @palm_major: Touch major axis from which a contact is a palm.
+ * @palm_size: Touch size from which a contact is a palm.
+ * @thumb_ratio: Major/minor axis ratio (Q4) from which an edge contact is
+ *	a thumb.
+ * @thumb_angle: Orientation magnitude from which an edge contact is a thumb.
+ * @thumb_zone: Width in units of the edge band where thumbs rest.
+ *
+ * The remaining fields mirror the module parameters of the same name.
+ */
+struct magicmouse_config {
+	bool emulate_3button;
+	bool middle_click_3finger;
+	bool emulate_scroll_wheel;
+	bool stop_scroll_while_moving;
+	unsigned int stop_scroll_threshold;
+	unsigned int stop_scroll_holdoff_ms;
+	unsigned int scroll_speed;
+	unsigned int scroll_delay_pos_x;
+	unsigned int scroll_delay_pos_y;
+	bool scroll_acceleration;
+	bool scroll_kinetic;
+	unsigned int scroll_kinetic_decay;
+	unsigned int scroll_coalesce_us;
+	bool swipe_navigation;
+	unsigned int swipe_distance;
+	unsigned int swipe_time_ms;
+	bool tap_to_click;
+	unsigned int tap_time_ms;
+	unsigned int tap_double_ms;
+	unsigned int tap_travel;
+	unsigned int jitter_threshold;
+	unsigned int jitter_smoothing;
+	bool pointer_predict;
+	unsigned int pointer_predict_us;
+	unsigned int pointer_predict_damping;
+	bool report_undeciphered;
+	unsigned int battery_interval_s;
+
+	int palm_major;
+	int palm_size;
+	int thumb_ratio;
+	int thumb_angle;
+	int thumb_zone;
+};
 
 /**
  * struct magicmouse_sc - Tracks Magic Mouse-specific data.
@@ -157,7 +604,70 @@ MODULE_PARM_DESC(report_undeciphered, "Report undeciphered multi-touch state fie
  * @scroll_jiffies: Time of last scroll motion.
  * @drag_start: Time of drag start.
  * @touches: Most recent data for a touch, indexed by tracking ID.
- * @tracking_ids: Mapping of current touch input data to @touches.
+ * @tracking_ids: Tracking IDs of the @ntouches touches counted so far in
+ *	the current report, in report order; palms and ignored contacts are
+ *	left out.
+ * @lock: Serializes input reporting between raw events and timers.
+ * @kinetic_timer: Emits coasting scroll events after a scroll finger lifts.
+ * @kinetic_vx: Horizontal coasting velocity, zero when not coasting.
+ * @kinetic_vy: Vertical coasting velocity, zero when not coasting.
+ * @kinetic_rx: Sub-unit horizontal remainder carried between ticks.
+ * @kinetic_ry: Sub-unit vertical remainder carried between ticks.
+ * @scroll_rem_x: Hi-res horizontal units not yet reported as a detent.
+ * @scroll_rem_y: Hi-res vertical units not yet reported as a detent.
+ * @coalesce_timer: Flushes coalesced scroll motion at the end of a window.
+ * @coalesce_x: Hi-res horizontal units held back in the current window.
+ * @coalesce_y: Hi-res vertical units held back in the current window.
+ * @motion: Pointer motion of the last MOTION_WINDOW mouse reports.
+ * @motion_sum: Sum of @motion.
+ * @motion_idx: Slot in @motion that the next report overwrites.
+ * @motion_last: Time of the last mouse report.
+ * @motion_jiffies: Time until which the mouse counts as moving.
+ * @swipe_last: Time of the last swipe, to send one key per gesture.
+ * @swipe_key: Navigation key pressed in the previous frame, 0 if none.
+ * @tap_timer: Releases a tap button once no follow-up touch arrived.
+ * @tap_state: Current state of the tap recognizer.
+ * @tap_start: Time the current tap candidate started.
+ * @tap_fingers: Number of fingers that took part in the tap candidate.
+ * @tap_double: Whether the candidate follows a tap (double tap or drag).
+ * @tap_buttons: Buttons held by the tap recognizer, same bits as clicks.
+ * @tap_starts: Touches that started in the current frame.
+ * @tap_moved: Whether a touch moved more than @cfg.tap_travel this frame.
+ * @predict_timer: Takes the prediction back once reports stop arriving.
+ * @predict_time: Time of the last Magic Mouse 2 motion report.
+ * @predict_vx: Estimated horizontal pointer velocity.
+ * @predict_vy: Estimated vertical pointer velocity.
+ * @predict_x: Horizontal offset by which the pointer currently leads.
+ * @predict_y: Vertical offset by which the pointer currently leads.
+ * @cfg: Tunables of this device.
+ * @curve: Scroll gain curve of this device, NULL for the fixed
+ *	acceleration. Protected by @lock.
+ * @zone_map: Zone flags per cell, used when @zone_map_set.
+ * @zone_map_set: Whether a zone map was loaded for this device.
+ * @zone_min_x: Left edge of the touch surface covered by @zone_map.
+ * @zone_min_y: Top edge of the touch surface covered by @zone_map.
+ * @zone_width: Width of the touch surface covered by @zone_map.
+ * @zone_height: Height of the touch surface covered by @zone_map.
+ * @removing: Set on removal so timers and the report thread stop reporting.
+ * @ring: Reports waiting for @worker in threaded mode, NULL otherwise.
+ * @ring_wait: Wakes @worker when @ring becomes non-empty.
+ * @worker: Per-device report thread in threaded mode.
+ * @mt_feature: Buffer for the multitouch feature report, allocated once.
+ * @mt_attempts: Multitouch enable attempts made so far.
+ * @mt_delay_ms: Delay before the next multitouch enable attempt.
+ * @mt_active: Set by the first report with touch data; stops further
+ *	attempts.
+ * @battery: Battery power supply, NULL if the device reports no battery.
+ * @battery_desc: Description of @battery.
+ * @battery_report: Report queried for the battery state.
+ * @battery_work: Issues a battery query outside of the receive path.
+ * @battery_next: Time before which no new battery query is issued.
+ * @battery_capacity: Last reported capacity in percent, -1 if unknown.
+ * @battery_status: Last reported POWER_SUPPLY_STATUS_* value.
+ * @probe_start: Time probe started.
+ * @phase_ns: Time from @probe_start to each phase, 0 until reached.
+ * @debugfs: Per-device debugfs directory.
+ * @frames: Decoded frame ring device, NULL unless frame_ring is set.
  */
 struct magicmouse_sc {
 	struct input_dev *input;
@@ -174,18 +684,105 @@ struct magicmouse_sc {
 		short y;
 		short scroll_x;
 		short scroll_y;
-		short scroll_x_hr;
-		short scroll_y_hr;
+		int scroll_x_acc;
+		int scroll_y_acc;
 		u8 size;
 		bool scroll_x_active;
 		bool scroll_y_active;
+		int scroll_vx;
+		int scroll_vy;
+		ktime_t scroll_time;
+		short start_x;
+		short start_y;
+		unsigned long swipe_jiffies;
+		bool swipe_done;
+		u8 contact;
+		u8 zone;
+		bool mt_down;
+		short filt_x;
+		short filt_y;
 	} touches[MAX_TOUCHES];
 	int tracking_ids[MAX_TOUCHES];
 
+	spinlock_t lock;
+	struct hrtimer kinetic_timer;
+	int kinetic_vx;
+	int kinetic_vy;
+	int kinetic_rx;
+	int kinetic_ry;
+	int scroll_rem_x;
+	int scroll_rem_y;
+	struct hrtimer coalesce_timer;
+	int coalesce_x;
+	int coalesce_y;
+	int motion[MOTION_WINDOW];
+	int motion_sum;
+	int motion_idx;
+	unsigned long motion_last;
+	unsigned long motion_jiffies;
+	unsigned long swipe_last;
+	unsigned int swipe_key;
+	struct hrtimer tap_timer;
+	enum magicmouse_tap_state tap_state;
+	ktime_t tap_start;
+	int tap_fingers;
+	bool tap_double;
+	int tap_buttons;
+	int tap_starts;
+	bool tap_moved;
+	struct hrtimer predict_timer;
+	ktime_t predict_time;
+	int predict_vx;
+	int predict_vy;
+	int predict_x;
+	int predict_y;
+
+	struct magicmouse_config cfg;
+	struct magicmouse_curve *curve;
+
+	u8 zone_map[ZONE_ROWS][ZONE_COLS];
+	bool zone_map_set;
+	int zone_min_x;
+	int zone_min_y;
+	int zone_width;
+	int zone_height;
+
+	bool removing;
+	struct magicmouse_ring *ring;
+	wait_queue_head_t ring_wait;
+	struct task_struct *worker;
+
+	u8 *mt_feature;
+	int mt_attempts;
+	unsigned int mt_delay_ms;
+	bool mt_active;
+
+	struct power_supply *battery;
+	struct power_supply_desc battery_desc;
+	struct hid_report *battery_report;
+	struct work_struct battery_work;
+	unsigned long battery_next;
+	int battery_capacity;
+	int battery_status;
+
+	ktime_t probe_start;
+	s64 phase_ns[PHASE_COUNT];
+	struct dentry *debugfs;
+
+	struct magicmouse_frames *frames;
+
 	struct hid_device *hdev;
 	struct delayed_work work;
 };
 
+static void magicmouse_mark_phase(struct magicmouse_sc *msc,
+		enum magicmouse_phase phase)
+{
+	if (!msc->phase_ns[phase])
+		msc->phase_ns[phase] =
+			ktime_to_ns(ktime_sub(ktime_get(), msc->probe_start));
+}
+
 static int magicmouse_firm_touch(struct magicmouse_sc *msc)
 {
 	int touch = -1;
@@ -196,7 +793,9 @@ static int magicmouse_firm_touch(struct magicmouse_sc *msc)
 	 */
 	for (ii = 0; ii < msc->ntouches; ii++) {
 		int idx = msc->tracking_ids[ii];
-		if (msc->touches[idx].size < 8) {
+		if (msc->touches[idx].size < 8 ||
+		    msc->touches[idx].contact != CONTACT_FINGER ||
+		    msc->touches[idx].zone & ZONE_IGNORE) {
 			/* Ignore this touch. */
 			continue;
 		} 
@@ -222,7 +821,8 @@ static int magicmouse_firm_touch_v2(struct magicmouse_sc *msc, int firmness)
 	 */
 	for (ii = 0; ii < msc->ntouches; ii++) {
 		int idx = msc->tracking_ids[ii];
-		if (msc->touches[idx].size < firmness) {
+		if (msc->touches[idx].size < firmness ||
+		    msc->touches[idx].contact != CONTACT_FINGER) {
 			/* Ignore this touch. */
 			continue;
 		} 
@@ -261,7 +861,8 @@ static int magicmouse_detect_3finger_click(struct magicmouse_sc *msc)
 
 	for (ii = 0; ii < msc->ntouches; ii++) {
 		int idx = msc->tracking_ids[ii];
-		if (msc->touches[idx].size > 0.1) {
+		if (msc->touches[idx].size > 0.1 &&
+		    msc->touches[idx].contact == CONTACT_FINGER) {
 			touch_size += msc->touches[idx].size;
 		}
 	}
@@ -276,7 +877,8 @@ static int magicmouse_detect_2fingers(struct magicmouse_sc *msc)
 
 	for (ii = 0; ii < msc->ntouches; ii++) {
 		int idx = msc->tracking_ids[ii];
-		if (msc->touches[idx].size > 0.1) {
+		if (msc->touches[idx].size > 0.1 &&
+		    msc->touches[idx].contact == CONTACT_FINGER) {
 			touch_size += msc->touches[idx].size;
 		}
 	}
@@ -299,13 +901,231 @@ static int magicmouse_detect_2fingers(struct magicmouse_sc *msc)
 	// return fingers == 2;
 }
 
+/* Fold touch motion into a per-axis accumulator kept in position units
+ * scaled by SCROLL_HR_STEPS, so partial steps carry over to the next frame.
+ * Returns the hi-res units to report, always a multiple of SCROLL_HR_MULT.
+ */
+static int magicmouse_scroll_accumulate(int *acc, int delta, int gain,
+		int step)
+{
+	int steps;
+
+	*acc += delta * SCROLL_HR_STEPS * gain;
+	steps = *acc / step;
+	*acc -= steps * step;
+
+	return steps * SCROLL_HR_MULT;
+}
+
+/* Called with msc->lock held. Look up the curve gain for a finger that
+ * moved @distance units in @dt_us. Velocity is in 1/256 units per ms so
+ * interpolation between two table entries stays in integer math.
+ */
+static int magicmouse_scroll_gain(struct magicmouse_sc *msc, int distance,
+		s64 dt_us)
+{
+	struct magicmouse_curve *curve = msc->curve;
+	int gain = SCROLL_GAIN_ONE;
+	unsigned int vel, idx, frac;
+
+	if (!curve || dt_us <= 0)
+		return gain;
+
+	vel = min_t(s64, div64_s64((s64)abs(distance) * 256 * 1000, dt_us),
+		    SCROLL_CURVE_MAX_VEL * 256);
+	idx = vel >> 8;
+	frac = vel & 0xff;
+	gain = curve->table[idx];
+	if (idx < SCROLL_CURVE_MAX_VEL)
+		gain += ((int)curve->table[idx + 1] - gain) * (int)frac >> 8;
+
+	return gain;
+}
+
+/* Report hi-res wheel motion and derive the low-resolution wheel from it,
+ * one detent every SCROLL_HR_UNITS, so both streams always agree.
+ */
+static void magicmouse_report_scroll(struct magicmouse_sc *msc,
+		int units_x, int units_y)
+{
+	struct input_dev *input = msc->input;
+	int detents;
+
+	if (units_x != 0) {
+		input_report_rel(input, REL_HWHEEL_HI_RES, units_x);
+		msc->scroll_rem_x += units_x;
+		detents = msc->scroll_rem_x / SCROLL_HR_UNITS;
+		if (detents != 0) {
+			msc->scroll_rem_x -= detents * SCROLL_HR_UNITS;
+			input_report_rel(input, REL_HWHEEL, detents);
+		}
+	}
+
+	if (units_y != 0) {
+		input_report_rel(input, REL_WHEEL_HI_RES, units_y);
+		msc->scroll_rem_y += units_y;
+		detents = msc->scroll_rem_y / SCROLL_HR_UNITS;
+		if (detents != 0) {
+			msc->scroll_rem_y -= detents * SCROLL_HR_UNITS;
+			input_report_rel(input, REL_WHEEL, detents);
+		}
+	}
+}
+
+/* Called with msc->lock held. Reports any scroll motion held back by the
+ * coalescing window right away, e.g. on lift-off or click.
+ */
+static void magicmouse_flush_scroll(struct magicmouse_sc *msc)
+{
+	if (msc->coalesce_x == 0 && msc->coalesce_y == 0)
+		return;
+
+	magicmouse_report_scroll(msc, msc->coalesce_x, msc->coalesce_y);
+	msc->coalesce_x = 0;
+	msc->coalesce_y = 0;
+	hrtimer_try_to_cancel(&msc->coalesce_timer);
+}
+
+/* Report scroll motion, or with scroll_coalesce_us set, hold it back and
+ * merge it with the rest of the window so a fast swipe produces one wheel
+ * event per window instead of one per report.
+ */
+static void magicmouse_queue_scroll(struct magicmouse_sc *msc,
+		int units_x, int units_y)
+{
+	unsigned int window = msc->cfg.scroll_coalesce_us;
+	bool idle = msc->coalesce_x == 0 && msc->coalesce_y == 0;
+
+	if (window == 0) {
+		magicmouse_flush_scroll(msc);
+		magicmouse_report_scroll(msc, units_x, units_y);
+		return;
+	}
+
+	msc->coalesce_x += units_x;
+	msc->coalesce_y += units_y;
+
+	if (idle)
+		hrtimer_start(&msc->coalesce_timer, us_to_ktime(window),
+			      HRTIMER_MODE_REL);
+}
+
+static enum hrtimer_restart magicmouse_coalesce_timer(struct hrtimer *timer)
+{
+	struct magicmouse_sc *msc =
+		container_of(timer, struct magicmouse_sc, coalesce_timer);
+
+	spin_lock(&msc->lock);
+	if (!msc->removing && (msc->coalesce_x != 0 || msc->coalesce_y != 0)) {
+		magicmouse_report_scroll(msc, msc->coalesce_x, msc->coalesce_y);
+		msc->coalesce_x = 0;
+		msc->coalesce_y = 0;
+		input_sync(msc->input);
+	}
+	spin_unlock(&msc->lock);
+
+	return HRTIMER_NORESTART;
+}
+
+static int magicmouse_kinetic_step(int *velocity, int *remainder, int decay)
+{
+	int units;
+
+	*remainder += *velocity * (SCROLL_KINETIC_TICK_US / 1000);
+	units = *remainder / (1000 * SCROLL_HR_MULT) * SCROLL_HR_MULT;
+	*remainder -= units * 1000;
+
+	*velocity -= *velocity * decay / 100;
+	if (abs(*velocity) < SCROLL_KINETIC_STOP)
+		*velocity = 0;
+
+	return units;
+}
+
+static enum hrtimer_restart magicmouse_kinetic_timer(struct hrtimer *timer)
+{
+	struct magicmouse_sc *msc =
+		container_of(timer, struct magicmouse_sc, kinetic_timer);
+	enum hrtimer_restart ret = HRTIMER_NORESTART;
+	int step_x, step_y;
+
+	spin_lock(&msc->lock);
+
+	if (msc->removing || (msc->kinetic_vx == 0 && msc->kinetic_vy == 0))
+		goto out;
+
+	step_x = magicmouse_kinetic_step(&msc->kinetic_vx, &msc->kinetic_rx,
+					 msc->cfg.scroll_kinetic_decay);
+	step_y = magicmouse_kinetic_step(&msc->kinetic_vy, &msc->kinetic_ry,
+					 msc->cfg.scroll_kinetic_decay);
+
+	if (step_x != 0 || step_y != 0) {
+		magicmouse_report_scroll(msc, step_x, step_y);
+		input_sync(msc->input);
+	}
+
+	if (msc->kinetic_vx != 0 || msc->kinetic_vy != 0) {
+		hrtimer_forward_now(timer, us_to_ktime(SCROLL_KINETIC_TICK_US));
+		ret = HRTIMER_RESTART;
+	}
+out:
+	spin_unlock(&msc->lock);
+	return ret;
+}
+
+/* Called with msc->lock held. The timer callback takes the same lock, so
+ * only try to cancel it here; a callback already waiting for the lock sees
+ * zero velocity and does not rearm.
+ */
+static void magicmouse_kinetic_stop(struct magicmouse_sc *msc)
+{
+	msc->kinetic_vx = 0;
+	msc->kinetic_vy = 0;
+	hrtimer_try_to_cancel(&msc->kinetic_timer);
+}
+
+static void magicmouse_kinetic_start(struct magicmouse_sc *msc, int vx, int vy)
+{
+	if (abs(vx) < SCROLL_KINETIC_START)
+		vx = 0;
+	if (abs(vy) < SCROLL_KINETIC_START)
+		vy = 0;
+	if (vx == 0 && vy == 0)
+		return;
+
+	msc->kinetic_vx = clamp(vx, -SCROLL_KINETIC_MAX, SCROLL_KINETIC_MAX);
+	msc->kinetic_vy = clamp(vy, -SCROLL_KINETIC_MAX, SCROLL_KINETIC_MAX);
+	msc->kinetic_rx = 0;
+	msc->kinetic_ry = 0;
+	hrtimer_start_range_ns(&msc->kinetic_timer,
+			       us_to_ktime(SCROLL_KINETIC_TICK_US),
+			       SCROLL_KINETIC_SLACK_US * NSEC_PER_USEC,
+			       HRTIMER_MODE_REL);
+}
+
+/* Fold the hi-res units emitted this frame into a smoothed velocity so the
+ * release speed reflects the last few drag frames rather than a single one.
+ */
+static int magicmouse_scroll_velocity(int velocity, int units, s64 dt_us)
+{
+	s64 inst;
+
+	if (dt_us <= 0)
+		return velocity;
+
+	inst = div64_s64((s64)units * USEC_PER_SEC, dt_us);
+	inst = clamp_t(s64, inst, -SCROLL_KINETIC_MAX, SCROLL_KINETIC_MAX);
+
+	return (3 * velocity + (int)inst) / 4;
+}
+
 static void magicmouse_emit_buttons(struct magicmouse_sc *msc, int state)
 {
 	int last_state = test_bit(BTN_LEFT, msc->input->key) << 0 |
 		test_bit(BTN_RIGHT, msc->input->key) << 1 |
 		test_bit(BTN_MIDDLE, msc->input->key) << 2;
 
-	if (emulate_3button) {
+	if (msc->cfg.emulate_3button) {
 		int id;
 
 		id = magicmouse_firm_touch(msc);
@@ -323,7 +1143,7 @@ static void magicmouse_emit_buttons(struct magicmouse_sc *msc, int state)
 			// }	
 		} else if (last_state != 0) {
 			state = last_state;
-		} else if (id >= 0 && middle_click_3finger){
+		} else if (id >= 0 && msc->cfg.middle_click_3finger){
 			int x;
 			x = msc->touches[id].x;
 			if (magicmouse_detect_2fingers(msc))
@@ -332,16 +1152,13 @@ static void magicmouse_emit_buttons(struct magicmouse_sc *msc, int state)
 				state = 1;
 			else if (x > 0)
 				state = 2;
-		} else if (id >= 0) {
-			int x = msc->touches[id].x;
-			if (x < middle_button_start)
-				state = 1;
-			else if (x > middle_button_stop)
-				state = 2;
-			else
-				state = 4;
+		} else if (id >= 0 &&
+			   (msc->touches[id].zone & ZONE_CLICK_MASK)) {
+			state = msc->touches[id].zone & ZONE_CLICK_MASK;
 		}/* else: we keep the mouse's guess */
 
+		state |= msc->tap_buttons;
+
 		// int t_count = magicmouse_firm_touch_v2(msc);
 
 		// if (state == 0) {
@@ -353,211 +1170,636 @@ static void magicmouse_emit_buttons(struct magicmouse_sc *msc, int state)
 		// 		state = 4;
 		// 	}
 		// }
-
-		input_report_key(msc->input, BTN_MIDDLE, state & 4);
+	} else {
+		state |= msc->tap_buttons;
 	}
 
+	/* Also releases a middle button held when emulation was switched
+	 * off.
+	 */
+	input_report_key(msc->input, BTN_MIDDLE, state & 4);
 	input_report_key(msc->input, BTN_LEFT, state & 1);
 	input_report_key(msc->input, BTN_RIGHT, state & 2);
 
-	if (state != last_state)
+	if (state != last_state) {
 		msc->scroll_accel = SCROLL_ACCEL_DEFAULT;
+		magicmouse_flush_scroll(msc);
+	}
+}
+
+/* Track pointer motion over a short sliding window of reports. A single
+ * twitchy report does not count as moving, but once the window sum crosses
+ * stop_scroll_threshold scrolling stays off for stop_scroll_holdoff_ms.
+ */
+static void magicmouse_track_motion(struct magicmouse_sc *msc, int x, int y)
+{
+	unsigned long now = jiffies;
+	int motion = abs(x) + abs(y);
+
+	if (time_after(now, msc->motion_last + MOTION_WINDOW_GAP)) {
+		memset(msc->motion, 0, sizeof(msc->motion));
+		msc->motion_sum = 0;
+	}
+	msc->motion_last = now;
+
+	msc->motion_sum += motion - msc->motion[msc->motion_idx];
+	msc->motion[msc->motion_idx] = motion;
+	msc->motion_idx = (msc->motion_idx + 1) % MOTION_WINDOW;
+
+	if (msc->motion_sum > (int)msc->cfg.stop_scroll_threshold)
+		msc->motion_jiffies = now +
+			msecs_to_jiffies(msc->cfg.stop_scroll_holdoff_ms);
+}
+
+static int magicmouse_predict_velocity(int velocity, int motion, s64 dt_us,
+		int damping)
+{
+	int sample = clamp_t(s64, div_s64((s64)motion *
+		(USEC_PER_MSEC << PREDICT_VEL_SHIFT), dt_us),
+		-PREDICT_VEL_MAX, PREDICT_VEL_MAX);
+
+	return (velocity * damping + sample * (100 - damping)) / 100;
+}
+
+static int magicmouse_predict_offset(int velocity, unsigned int horizon_us)
+{
+	return clamp_t(s64, div_s64((s64)velocity * horizon_us,
+		USEC_PER_MSEC << PREDICT_VEL_SHIFT),
+		-PREDICT_MAX_OFFSET, PREDICT_MAX_OFFSET);
+}
+
+/* Lead the pointer by the distance it is expected to travel within the
+ * prediction horizon, given motion that came @dt_us after the previous
+ * report. Each report first takes back the offset applied with the
+ * previous one, so the prediction never accumulates and the pointer ends
+ * where the device says once motion stops.
+ */
+static void magicmouse_predict_step(struct magicmouse_sc *msc, int *x,
+		int *y, s64 dt_us)
+{
+	unsigned int horizon_us = msc->cfg.pointer_predict ?
+		msc->cfg.pointer_predict_us : 0;
+	int damping = msc->cfg.pointer_predict_damping;
+	int px, py;
+
+	if (dt_us <= 0 || dt_us > PREDICT_GAP_US) {
+		msc->predict_vx = 0;
+		msc->predict_vy = 0;
+	} else {
+		msc->predict_vx = magicmouse_predict_velocity(msc->predict_vx,
+			*x, dt_us, damping);
+		msc->predict_vy = magicmouse_predict_velocity(msc->predict_vy,
+			*y, dt_us, damping);
+	}
+
+	px = magicmouse_predict_offset(msc->predict_vx, horizon_us);
+	py = magicmouse_predict_offset(msc->predict_vy, horizon_us);
+	*x += px - msc->predict_x;
+	*y += py - msc->predict_y;
+	msc->predict_x = px;
+	msc->predict_y = py;
+}
+
+static void magicmouse_predict_motion(struct magicmouse_sc *msc, int *x,
+		int *y)
+{
+	ktime_t now = ktime_get();
+	s64 dt_us = ktime_us_delta(now, msc->predict_time);
+
+	if (!msc->cfg.pointer_predict && !msc->predict_x && !msc->predict_y)
+		return;
+
+	msc->predict_time = now;
+	magicmouse_predict_step(msc, x, y, dt_us);
+
+	if (msc->predict_x || msc->predict_y)
+		hrtimer_start(&msc->predict_timer, us_to_ktime(PREDICT_IDLE_US),
+			      HRTIMER_MODE_REL);
+	else
+		hrtimer_try_to_cancel(&msc->predict_timer);
+}
+
+static enum hrtimer_restart magicmouse_predict_timer(struct hrtimer *timer)
+{
+	struct magicmouse_sc *msc =
+		container_of(timer, struct magicmouse_sc, predict_timer);
+
+	spin_lock(&msc->lock);
+	if (!msc->removing && (msc->predict_x != 0 || msc->predict_y != 0)) {
+		input_report_rel(msc->input, REL_X, -msc->predict_x);
+		input_report_rel(msc->input, REL_Y, -msc->predict_y);
+		input_sync(msc->input);
+	}
+	msc->predict_x = 0;
+	msc->predict_y = 0;
+	msc->predict_vx = 0;
+	msc->predict_vy = 0;
+	spin_unlock(&msc->lock);
+
+	return HRTIMER_NORESTART;
+}
+
+/* Recognize a quick horizontal swipe from the distance a touch covered
+ * since it started. Only the start position and time are kept per touch,
+ * and a swipe can only complete within swipe_time_ms of the touch start.
+ */
+static void magicmouse_detect_swipe(struct magicmouse_sc *msc, int id,
+		int x, int y, int state)
+{
+	unsigned long now = jiffies;
+	unsigned long timeout = msecs_to_jiffies(msc->cfg.swipe_time_ms);
+	int dx, dy;
+
+	switch (state) {
+	case TOUCH_STATE_START:
+		msc->touches[id].swipe_jiffies = now;
+		msc->touches[id].swipe_done = false;
+		break;
+	case TOUCH_STATE_DRAG:
+		if (msc->touches[id].swipe_done ||
+		    time_after(now, msc->touches[id].swipe_jiffies + timeout))
+			break;
+
+		dx = x - msc->touches[id].start_x;
+		dy = y - msc->touches[id].start_y;
+		if (abs(dx) < msc->cfg.swipe_distance || abs(dx) < 2 * abs(dy))
+			break;
+
+		/* Every finger of a two-finger swipe gets here; send one key. */
+		msc->touches[id].swipe_done = true;
+		if (time_before(now, msc->swipe_last + timeout))
+			break;
+		msc->swipe_last = now;
+
+		msc->swipe_key = dx > 0 ? KEY_BACK : KEY_FORWARD;
+		input_report_key(msc->input, msc->swipe_key, 1);
+		break;
+	}
+}
+
+static void magicmouse_tap_press(struct magicmouse_sc *msc, int buttons)
+{
+	msc->tap_buttons = buttons;
+	input_report_key(msc->input, BTN_LEFT, buttons & 1);
+	input_report_key(msc->input, BTN_RIGHT, buttons & 2);
+	input_report_key(msc->input, BTN_MIDDLE, buttons & 4);
+}
+
+static enum hrtimer_restart magicmouse_tap_timer(struct hrtimer *timer)
+{
+	struct magicmouse_sc *msc =
+		container_of(timer, struct magicmouse_sc, tap_timer);
+
+	spin_lock(&msc->lock);
+	if (!msc->removing && msc->tap_state == TAP_RELEASED) {
+		magicmouse_tap_press(msc, 0);
+		input_sync(msc->input);
+		msc->tap_state = TAP_IDLE;
+	}
+	spin_unlock(&msc->lock);
+
+	return HRTIMER_NORESTART;
+}
+
+/* Advance the tap recognizer once per mouse report, after all touches of
+ * the report were decoded. A tap is a touch of up to three fingers that
+ * lifts within tap_time_ms without moving more than tap_travel or
+ * clicking. Its button stays pressed for tap_double_ms; a new touch in that
+ * time completes the click and either taps again (double tap) or, if the
+ * finger moves, presses the left button again and drags.
+ */
+static void magicmouse_tap_frame(struct magicmouse_sc *msc, int clicks)
+{
+	static const int tap_buttons[] = { 0, 1, 2, 4 };
+	ktime_t now = ktime_get();
+
+	if (msc->tap_starts && (msc->tap_state == TAP_IDLE ||
+				msc->tap_state == TAP_RELEASED)) {
+		msc->tap_double = msc->tap_state == TAP_RELEASED;
+		if (msc->tap_double) {
+			/* Complete the click of the previous tap. */
+			hrtimer_try_to_cancel(&msc->tap_timer);
+			magicmouse_tap_press(msc, 0);
+		}
+		msc->tap_state = TAP_TOUCH;
+		msc->tap_start = now;
+		msc->tap_fingers = 0;
+	}
+
+	switch (msc->tap_state) {
+	case TAP_TOUCH:
+		msc->tap_fingers += msc->tap_starts;
+
+		if (clicks || msc->tap_fingers > 3 ||
+		    ktime_ms_delta(now, msc->tap_start) > msc->cfg.tap_time_ms) {
+			msc->tap_state = TAP_INVALID;
+		} else if (msc->tap_moved) {
+			if (msc->tap_double && msc->tap_fingers == 1) {
+				msc->tap_state = TAP_DRAG;
+				magicmouse_tap_press(msc, 1);
+			} else {
+				msc->tap_state = TAP_INVALID;
+			}
+		} else if (msc->ntouches == 0) {
+			msc->tap_state = TAP_RELEASED;
+			magicmouse_tap_press(msc, tap_buttons[msc->tap_fingers]);
+			hrtimer_start(&msc->tap_timer, ms_to_ktime(msc->cfg.tap_double_ms),
+				      HRTIMER_MODE_REL);
+		}
+		break;
+	case TAP_DRAG:
+		if (msc->ntouches == 0) {
+			magicmouse_tap_press(msc, 0);
+			msc->tap_state = TAP_IDLE;
+		}
+		break;
+	case TAP_INVALID:
+		if (msc->ntouches == 0)
+			msc->tap_state = TAP_IDLE;
+		break;
+	default:
+		break;
+	}
+
+	msc->tap_starts = 0;
+	msc->tap_moved = false;
+}
+
+/* Look up the zone of a touch position, one grid cell per position. */
+static u8 magicmouse_zone(struct magicmouse_sc *msc, int x, int y)
+{
+	int col, row;
+
+	if (!msc->zone_map_set) {
+		if (x < middle_button_start)
+			return 1 | ZONE_NO_SCROLL;
+		if (x > middle_button_stop)
+			return 2 | ZONE_NO_SCROLL;
+		return 4;
+	}
+
+	col = (x - msc->zone_min_x) * ZONE_COLS / msc->zone_width;
+	row = (y - msc->zone_min_y) * ZONE_ROWS / msc->zone_height;
+
+	return msc->zone_map[clamp(row, 0, ZONE_ROWS - 1)]
+			    [clamp(col, 0, ZONE_COLS - 1)];
+}
+
+/* Classify a contact from its shape and position using the per-device
+ * thresholds. Large contacts are palms. Elongated or strongly rotated
+ * contacts resting in the edge band (the bottom of a trackpad, the sides
+ * of a mouse) are thumbs.
+ */
+static enum magicmouse_contact magicmouse_classify(struct magicmouse_sc *msc,
+		int x, int y, int size, int orientation, int major, int minor)
+{
+	struct input_dev *input = msc->input;
+	bool edge;
+
+	if (major >= msc->cfg.palm_major || size >= msc->cfg.palm_size)
+		return CONTACT_PALM;
+
+	if (input->id.product == USB_DEVICE_ID_APPLE_MAGICMOUSE ||
+	    input->id.product == USB_DEVICE_ID_APPLE_MAGICMOUSE2)
+		edge = x < MOUSE_MIN_X + msc->cfg.thumb_zone ||
+		       x > MOUSE_MAX_X - msc->cfg.thumb_zone;
+	else if (input->id.product == USB_DEVICE_ID_APPLE_MAGICTRACKPAD)
+		edge = y > TRACKPAD_MAX_Y - msc->cfg.thumb_zone;
+	else
+		edge = y > TRACKPAD2_MAX_Y - msc->cfg.thumb_zone;
+
+	if (edge && (major * THUMB_RATIO_ONE >= minor * msc->cfg.thumb_ratio ||
+		     abs(orientation) >= msc->cfg.thumb_angle))
+		return CONTACT_THUMB;
+
+	return CONTACT_FINGER;
+}
+
+static struct magicmouse_frame *magicmouse_frame_slot(
+		struct magicmouse_frame_ring *ring, u32 seq)
+{
+	return (void *)ring + ring->frames_offset +
+		(seq % FRAME_RING_SIZE) * sizeof(struct magicmouse_frame);
+}
+
+/* Add a contact to the frame being written. Called under msc->lock. */
+static void magicmouse_frame_touch(struct magicmouse_sc *msc,
+		const struct magicmouse_touch *touch)
+{
+	struct magicmouse_frame_ring *ring = msc->frames->ring;
+	struct magicmouse_frame *frame = magicmouse_frame_slot(ring, ring->head);
+	struct magicmouse_frame_touch *ft;
+
+	if (frame->ntouches >= MAGICMOUSE_FRAME_TOUCHES)
+		return;
+
+	ft = &frame->touch[frame->ntouches++];
+	ft->id = touch->id;
+	ft->state = touch->state;
+	ft->x = touch->x;
+	ft->y = touch->y;
+	ft->touch_major = touch->touch_major;
+	ft->touch_minor = touch->touch_minor;
+	ft->size = touch->size;
+	ft->orientation = touch->orientation;
+}
+
+/* Publish the frame being written and start the next one. Called under
+ * msc->lock, which makes the driver the single producer.
+ */
+static void magicmouse_frame_commit(struct magicmouse_sc *msc, int buttons,
+		int x, int y)
+{
+	struct magicmouse_frames *frames = msc->frames;
+	struct magicmouse_frame_ring *ring = frames->ring;
+	u32 head = ring->head;
+	struct magicmouse_frame *frame = magicmouse_frame_slot(ring, head);
+
+	frame->time_ns = ktime_get_ns();
+	frame->seq = head;
+	frame->buttons = buttons;
+	frame->rel_x = x;
+	frame->rel_y = y;
+	smp_store_release(&ring->head, head + 1);
+
+	/* The next slot holds the oldest frame, which readers already
+	 * treat as overwritten.
+	 */
+	magicmouse_frame_slot(ring, head + 1)->ntouches = 0;
+
+	if (wq_has_sleeper(&frames->wait))
+		wake_up_interruptible(&frames->wait);
+}
+
+/* Hysteresis and IIR filter for reported contact positions: movement
+ * within the threshold is dropped, so a resting finger produces no
+ * events, movement just past it is smoothed, and larger movement is
+ * passed through unchanged.
+ */
+static int magicmouse_dejitter(int old, int value, int threshold,
+		int smoothing)
+{
+	int delta = value - old;
+
+	if (abs(delta) <= threshold)
+		return old;
+	if (abs(delta) > JITTER_SNAP * threshold)
+		return value;
+	return old + delta * (100 - smoothing) / 100;
+}
+
+/* Select the MT slot of a contact; false if every slot is taken. */
+static bool magicmouse_mt_slot(struct input_dev *input, int id)
+{
+	int slot = input_mt_get_slot_by_key(input, id);
+
+	if (slot < 0)
+		return false;
+
+	input_mt_slot(input, slot);
+	return true;
 }
 
 static void magicmouse_emit_touch(struct magicmouse_sc *msc, int raw_id,
 		u8 *tdata, int npoints, int mouse_loc_x, int mouse_loc_y)
 {
 	struct input_dev *input = msc->input;
+	struct magicmouse_touch touch;
 	int id, x, y, size, orientation, touch_major, touch_minor, state, down;
 	int pressure = 0;
 
-	/* tdata is 8 bytes per finger detected.
-		* tdata[0] (lsb of x) and least sig 4bits of tdata[1] (msb of x)
-		*          are x position of touch on touch surface.
-		* tdata[1] most sig 4bits (lsb of y) and and tdata[2] (msb of y)
-		*          are y position of touch on touch surface.
-		* tdata[1] bits look like [y y y y x x x x]
-		* tdata[3] touch major axis of ellipse of finger detected
-		* tdata[4] touch minor axis of ellipse of finger detected
-		* tdata[5] contains 6bits of size info (lsb) and the two msb of tdata[5]
-		*          are the lsb of id: [id id size size size size size size]
-		* tdata[6] 2 lsb bits of tdata[6] are the msb of id and 6msb of tdata[6]
-		*          are the orientation of the touch. [o o o o o o id id]
-		* tdata[7] 4 msb are state. 4lsb are unknown.
-		*
-		* [ x x x x x x x x ]
-		* [ y y y y x x x x ]
-		* [ y y y y y y y y ]
-		* [touch major      ]
-		* [touch minor      ]
-		* [id id s s s s s s]
-		* [o o o o o o id id]
-		* [s s s s | unknown]
-		*/
-	id = (tdata[6] << 2 | tdata[5] >> 6) & 0xf;
-	x = (tdata[1] << 28 | tdata[0] << 20) >> 20;
-	y = -((tdata[2] << 24 | tdata[1] << 16) >> 20);
-	size = tdata[5] & 0x3f;
-	orientation = (tdata[6] >> 2) - 32;
-	touch_major = tdata[3];
-	touch_minor = tdata[4];
-	state = tdata[7] & TOUCH_STATE_MASK;
+	magicmouse_mark_phase(msc, PHASE_FIRST_TOUCH);
+
+	/* See magicmouse_decode_touch() for the touch record layout. */
+	magicmouse_decode_touch(tdata, &touch);
+	if (msc->frames)
+		magicmouse_frame_touch(msc, &touch);
+	id = touch.id;
+	x = touch.x;
+	y = touch.y;
+	size = touch.size;
+	orientation = touch.orientation;
+	touch_major = touch.touch_major;
+	touch_minor = touch.touch_minor;
+	state = touch.state;
 	down = state != TOUCH_STATE_NONE;
 
-	/* Store tracking ID and other fields. */
-	msc->tracking_ids[raw_id] = id;
+	/* Store the fields; the tracking ID is only recorded below, for
+	 * contacts that are counted in ntouches.
+	 */
 	msc->touches[id].x = x;
 	msc->touches[id].y = y;
 	msc->touches[id].size = size;
 
+	/* Classify the contact before any scroll or button logic sees it. */
+	if (state == TOUCH_STATE_START)
+		msc->touches[id].contact = CONTACT_FINGER;
+	if (down)
+		msc->touches[id].contact = max_t(u8, msc->touches[id].contact,
+			magicmouse_classify(msc, x, y, size, orientation,
+					    touch_major, touch_minor));
+
+	msc->touches[id].zone = magicmouse_zone(msc, x, y);
+
+	/* Palms, and contacts in ignored cells of the zone map, get no slot
+	 * and take no part in taps, swipes or scrolling.
+	 */
+	if (msc->touches[id].contact == CONTACT_PALM ||
+	    msc->touches[id].zone & ZONE_IGNORE) {
+		/* Lift a contact that was reported before it grew or moved
+		 * into an ignored cell.
+		 */
+		if (msc->touches[id].mt_down &&
+		    magicmouse_mt_slot(input, id)) {
+			input_mt_report_slot_state(input, MT_TOOL_FINGER, false);
+			msc->touches[id].mt_down = false;
+		}
+		return;
+	}
+
+	if (state == TOUCH_STATE_START) {
+		msc->touches[id].start_x = x;
+		msc->touches[id].start_y = y;
+		if (msc->cfg.tap_to_click)
+			msc->tap_starts++;
+	} else if (state == TOUCH_STATE_DRAG && msc->cfg.tap_to_click &&
+		   (abs(x - msc->touches[id].start_x) > msc->cfg.tap_travel ||
+		    abs(y - msc->touches[id].start_y) > msc->cfg.tap_travel)) {
+		msc->tap_moved = true;
+	}
+
+	if (msc->cfg.swipe_navigation &&
+	    (input->id.product == USB_DEVICE_ID_APPLE_MAGICMOUSE ||
+	     input->id.product == USB_DEVICE_ID_APPLE_MAGICMOUSE2))
+		magicmouse_detect_swipe(msc, id, x, y, state);
+
 	/* If requested, emulate a scroll wheel by detecting small
 	 * vertical touch motions.
 	 */
-	if (emulate_scroll_wheel) {
+	if (msc->cfg.emulate_scroll_wheel &&
+	    msc->touches[id].contact == CONTACT_FINGER) {
 		unsigned long now = jiffies;
-		int step_x = msc->touches[id].scroll_x - x;
-		int step_y = msc->touches[id].scroll_y - y;
-		int step_hr = ((128 - (int)scroll_speed) * msc->scroll_accel) /
-			      SCROLL_HR_STEPS;
-		int step_x_hr = msc->touches[id].scroll_x_hr - x;
-		int step_y_hr = msc->touches[id].scroll_y_hr - y;
+		ktime_t now_kt = ktime_get();
+		s64 dt_us = ktime_us_delta(now_kt, msc->touches[id].scroll_time);
+		int units_x = 0, units_y = 0;
+		int step = (128 - (int)msc->cfg.scroll_speed) * msc->scroll_accel *
+			   SCROLL_GAIN_ONE;
+		int gain;
+		int delta_x = x - msc->touches[id].scroll_x;
+		int delta_y = msc->touches[id].scroll_y - y;
+		int t_touches;
 
 		/* Determine if the mouse has moved, if so then disable scrolling. */
-		bool continue_scroll = true;
-		// if (stop_scroll_while_moving)
-		// {
-		// 	continue_scroll = msc->x == mouse_loc_x && msc->y == mouse_loc_y;
-		// }
+		bool mouse_moving = msc->cfg.stop_scroll_while_moving &&
+			time_before(now, msc->motion_jiffies);
+
+		/* Calculate and apply the scroll motion. */
+		switch (state) {
+		case TOUCH_STATE_START:
+			msc->touches[id].scroll_x = x;
+			msc->touches[id].scroll_y = y;
+			msc->touches[id].scroll_x_acc = 0;
+			msc->touches[id].scroll_y_acc = 0;
+			msc->touches[id].scroll_x_active = false;
+			msc->touches[id].scroll_y_active = false;
+			msc->touches[id].scroll_vx = 0;
+			msc->touches[id].scroll_vy = 0;
+			msc->touches[id].scroll_time = now_kt;
+
+			/* A new touch catches the coasting wheel. */
+			magicmouse_kinetic_stop(msc);
+			msc->scroll_rem_x = 0;
+			msc->scroll_rem_y = 0;
+
+			/* Reset acceleration after half a second. */
+			if (msc->cfg.scroll_acceleration && time_before(now,
+						msc->scroll_jiffies + HZ / 2))
+				msc->scroll_accel = max_t(int,
+						msc->scroll_accel - 1, 1);
+			else
+				msc->scroll_accel = SCROLL_ACCEL_DEFAULT;
+
+			break;
+		case TOUCH_STATE_DRAG:
+			// if (!magicmouse_detect_2fingers(msc)) {
+			t_touches = magicmouse_firm_touch_v2(msc, 5);
+			// if (msc->ntouches != 1 || t_touches != msc->ntouches) {
+			if (t_touches != 0 ||
+			    msc->touches[id].zone & (ZONE_NO_SCROLL | ZONE_IGNORE) ||
+			    mouse_moving) {
+				delta_x = 0;
+				delta_y = 0;
+			}
+
+			/* Horizontal motion that may still become a swipe
+			 * must not leak out as wheel events.
+			 */
+			if (msc->cfg.swipe_navigation && (msc->touches[id].swipe_done ||
+			    time_before(now, msc->touches[id].swipe_jiffies +
+					msecs_to_jiffies(msc->cfg.swipe_time_ms))))
+				delta_x = 0;
+
+			/* Add a position delay since the drag start in which
+			* drag events are not registered. This decreases the
+			* sensitivity of dragging on Magic Mouse devices.
+			*/
+			if (!msc->touches[id].scroll_x_active &&
+				abs(delta_x) > msc->cfg.scroll_delay_pos_x) {
+				msc->touches[id].scroll_x_active = true;
+				delta_x = 0;
+			}
+
+			if (!msc->touches[id].scroll_y_active &&
+				abs(delta_y) > msc->cfg.scroll_delay_pos_y) {
+				msc->touches[id].scroll_y_active = true;
+				delta_y = 0;
+			}
+
+			gain = magicmouse_scroll_gain(msc,
+				max(abs(delta_x), abs(delta_y)), dt_us);
 
-		if (continue_scroll) {
-			/* Calculate and apply the scroll motion. */
-			switch (state) {
-			case TOUCH_STATE_START:
+			if (msc->touches[id].scroll_x_active) {
+				units_x = magicmouse_scroll_accumulate(
+					&msc->touches[id].scroll_x_acc,
+					delta_x, gain, step);
 				msc->touches[id].scroll_x = x;
+			}
+
+			if (msc->touches[id].scroll_y_active) {
+				units_y = magicmouse_scroll_accumulate(
+					&msc->touches[id].scroll_y_acc,
+					delta_y, gain, step);
 				msc->touches[id].scroll_y = y;
-				msc->touches[id].scroll_x_hr = x;
-				msc->touches[id].scroll_y_hr = y;
-				msc->touches[id].scroll_x_active = false;
-				msc->touches[id].scroll_y_active = false;
-
-				/* Reset acceleration after half a second. */
-				if (scroll_acceleration && time_before(now,
-							msc->scroll_jiffies + HZ / 2))
-					msc->scroll_accel = max_t(int,
-							msc->scroll_accel - 1, 1);
-				else
-					msc->scroll_accel = SCROLL_ACCEL_DEFAULT;
-
-				break;
-			case TOUCH_STATE_DRAG:
-				/* Add a position delay since the drag start in which
-				* drag events are not registered. This decreases the
-				* sensitivity of dragging on Magic Mouse devices.
-				*/
-				if (abs(step_x) < scroll_delay_pos_x) {
-					step_x = 0;
-				} else {
-					step_x /= (64 - (int)scroll_speed) * msc->scroll_accel;
-				}
-
-				if (abs(step_y) < scroll_delay_pos_y) {
-					step_y = 0;
-				} else {
-					step_y /= (64 - (int)scroll_speed) * msc->scroll_accel;
-				}
-
-				// if (!magicmouse_detect_2fingers(msc)) {
-				int t_touches = magicmouse_firm_touch_v2(msc, 5);
-				// if (msc->ntouches != 1 || t_touches != msc->ntouches) {
-				if (t_touches != 0 || x < middle_button_start || x > middle_button_stop) {
-					step_x = 0;
-					step_y = 0;
-					step_x_hr = 0;
-					step_y_hr = 0;
-				}
-
-				// if (abs(msc->x - mouse_loc_x) > 3) {
-				// 	step_x = 0;
-				// 	step_x_hr = 0;
-				// }
-
-				// if (abs(msc->y - mouse_loc_y) > 3) {
-				// 	step_y = 0;
-				// 	step_y_hr = 0;
-				// }
-
-				if (step_x != 0) {
-					msc->touches[id].scroll_x -= step_x *
-						(64 - scroll_speed) * msc->scroll_accel;
-					msc->scroll_jiffies = now;
-					input_report_rel(input, REL_HWHEEL, -step_x);
-				}
-
-				if (step_y != 0) {
-					msc->touches[id].scroll_y -= step_y *
-						(64 - scroll_speed) * msc->scroll_accel;
-					msc->scroll_jiffies = now;
-					input_report_rel(input, REL_WHEEL, step_y);
-				}
-
-				if (!msc->touches[id].scroll_x_active &&
-					abs(step_x_hr) > SCROLL_HR_THRESHOLD) {
-					msc->touches[id].scroll_x_active = true;
-					msc->touches[id].scroll_x_hr = x;
-					step_x_hr = 0;
-				}
-
-				step_x_hr /= step_hr;
-				if (step_x_hr != 0 &&
-					msc->touches[id].scroll_x_active) {
-					msc->touches[id].scroll_x_hr -= step_x_hr *
-						step_hr;
-					input_report_rel(input,
-							REL_HWHEEL_HI_RES,
-							-step_x_hr * SCROLL_HR_MULT);
-				}
-
-				if (!msc->touches[id].scroll_y_active &&
-					abs(step_y_hr) > SCROLL_HR_THRESHOLD) {
-					msc->touches[id].scroll_y_active = true;
-					msc->touches[id].scroll_y_hr = y;
-					step_y_hr = 0;
-				}
-
-				step_y_hr /= step_hr;
-				if (step_y_hr != 0 &&
-					msc->touches[id].scroll_y_active) {
-					msc->touches[id].scroll_y_hr -= step_y_hr *
-						step_hr;
-					input_report_rel(input,
-							REL_WHEEL_HI_RES,
-							step_y_hr * SCROLL_HR_MULT);
-				}
-				break;
 			}
+
+			if (units_x != 0 || units_y != 0) {
+				msc->scroll_jiffies = now;
+				magicmouse_queue_scroll(msc, units_x, units_y);
+			}
+
+			msc->touches[id].scroll_vx = magicmouse_scroll_velocity(
+				msc->touches[id].scroll_vx, units_x, dt_us);
+			msc->touches[id].scroll_vy = magicmouse_scroll_velocity(
+				msc->touches[id].scroll_vy, units_y, dt_us);
+			msc->touches[id].scroll_time = now_kt;
+			break;
+		case TOUCH_STATE_NONE:
+			magicmouse_flush_scroll(msc);
+
+			/* The finger lifted: keep the wheel coasting
+			 * with the speed it had on release.
+			 */
+			if (msc->cfg.scroll_kinetic &&
+			    (input->id.product == USB_DEVICE_ID_APPLE_MAGICMOUSE ||
+			     input->id.product == USB_DEVICE_ID_APPLE_MAGICMOUSE2) &&
+			    (msc->touches[id].scroll_x_active ||
+			     msc->touches[id].scroll_y_active))
+				magicmouse_kinetic_start(msc,
+					msc->touches[id].scroll_vx,
+					msc->touches[id].scroll_vy);
+			break;
 		}
 	}
 
 	if (down)
-		msc->ntouches++;
+		msc->tracking_ids[msc->ntouches++] = id;
 
-	input_mt_slot(input, input_mt_get_slot_by_key(input, id));
+	/* Only the reported position is filtered; scrolling, taps and
+	 * swipes above work on the raw one.
+	 */
+	if (!msc->touches[id].mt_down || !msc->cfg.jitter_threshold) {
+		msc->touches[id].filt_x = x;
+		msc->touches[id].filt_y = y;
+	} else {
+		msc->touches[id].filt_x = magicmouse_dejitter(
+			msc->touches[id].filt_x, x, msc->cfg.jitter_threshold,
+			msc->cfg.jitter_smoothing);
+		msc->touches[id].filt_y = magicmouse_dejitter(
+			msc->touches[id].filt_y, y, msc->cfg.jitter_threshold,
+			msc->cfg.jitter_smoothing);
+	}
+
+	if (!magicmouse_mt_slot(input, id))
+		return;
 	input_mt_report_slot_state(input, MT_TOOL_FINGER, down);
+	msc->touches[id].mt_down = down;
 
 	/* Generate the input events for this touch. */
 	if (down) {
 		input_report_abs(input, ABS_MT_TOUCH_MAJOR, touch_major << 2);
 		input_report_abs(input, ABS_MT_TOUCH_MINOR, touch_minor << 2);
 		input_report_abs(input, ABS_MT_ORIENTATION, -orientation);
-		input_report_abs(input, ABS_MT_POSITION_X, x);
-		input_report_abs(input, ABS_MT_POSITION_Y, y);
+		input_report_abs(input, ABS_MT_POSITION_X,
+				 msc->touches[id].filt_x);
+		input_report_abs(input, ABS_MT_POSITION_Y,
+				 msc->touches[id].filt_y);
 
 		if (input->id.product == USB_DEVICE_ID_APPLE_MAGICTRACKPAD2) {
 			input_report_abs(input, ABS_TOOL_WIDTH, size);
 			input_report_abs(input, ABS_MT_PRESSURE, pressure + 30);
 		}
 
-		if (report_undeciphered) {
+		if (msc->cfg.report_undeciphered) {
 			if (input->id.product == USB_DEVICE_ID_APPLE_MAGICMOUSE ||
 				input->id.product == USB_DEVICE_ID_APPLE_MAGICMOUSE2)
 				input_event(input, EV_MSC, MSC_RAW, tdata[7]);
@@ -567,13 +1809,19 @@ static void magicmouse_emit_touch(struct magicmouse_sc *msc, int raw_id,
 	}
 }
 
-static int magicmouse_raw_event(struct hid_device *hdev,
+static int magicmouse_handle_report(struct hid_device *hdev,
 		struct hid_report *report, u8 *data, int size)
 {
 	struct magicmouse_sc *msc = hid_get_drvdata(hdev);
 	struct input_dev *input = msc->input;
 	int x = 0, y = 0, ii, clicks = 0, npoints;
 
+	/* Release a navigation key pressed by a swipe in the last frame. */
+	if (msc->swipe_key) {
+		input_report_key(input, msc->swipe_key, 0);
+		msc->swipe_key = 0;
+	}
+
 	switch (data[0]) {
 	case TRACKPAD_REPORT_ID:
 	case TRACKPAD2_BT_REPORT_ID:
@@ -626,6 +1874,7 @@ static int magicmouse_raw_event(struct hid_device *hdev,
 		 */
 		x = (int)(((data[3] & 0x0c) << 28) | (data[1] << 22)) >> 22;
 		y = (int)(((data[3] & 0x30) << 26) | (data[2] << 22)) >> 22;
+		magicmouse_track_motion(msc, x, y);
 		for (ii = 0; ii < npoints; ii++)
 			magicmouse_emit_touch(msc, ii, data + ii * 8 + 6, npoints, x, y);
 
@@ -669,12 +1918,23 @@ static int magicmouse_raw_event(struct hid_device *hdev,
         }
         msc->ntouches = 0;
 
+	/* Touch data only arrives once multitouch is on, so stop retrying.
+	 * Motion-only reports also arrive before that and prove nothing.
+	 */
+	if (npoints > 0 && !READ_ONCE(msc->mt_active)) {
+		WRITE_ONCE(msc->mt_active, true);
+		cancel_delayed_work(&msc->work);
+		hid_dbg(hdev, "touch data after %d enable retries, %lld ms after probe\n",
+			msc->mt_attempts,
+			ktime_ms_delta(ktime_get(), msc->probe_start));
+	}
+
         /* When emulating three-button mode, it is important
          * to have the current touch information before
          * generating a click event.
          */
-        x = (int)((data[3] << 24) | (data[2] << 16)) >> 16;
-        y = (int)((data[5] << 24) | (data[4] << 16)) >> 16;
+        magicmouse2_decode_motion(data, &x, &y);
+        magicmouse_track_motion(msc, x, y);
 
 		// print the values of the first 14 bytes of data and number of points and size.
 		// printk("The contents of npoints are: %i\n", npoints);
@@ -693,32 +1953,212 @@ static int magicmouse_raw_event(struct hid_device *hdev,
 		/* Sometimes the trackpad sends two touch reports in one
 		 * packet.
 		 */
-		magicmouse_raw_event(hdev, report, data + 2, data[1]);
-		magicmouse_raw_event(hdev, report, data + 2 + data[1],
+		magicmouse_handle_report(hdev, report, data + 2, data[1]);
+		magicmouse_handle_report(hdev, report, data + 2 + data[1],
 			size - 2 - data[1]);
 		break;
 	default:
 		return 0;
 	}
 
-	if (input->id.product == USB_DEVICE_ID_APPLE_MAGICMOUSE ||
-		input->id.product == USB_DEVICE_ID_APPLE_MAGICMOUSE2) {
-		msc->x = x;
-		msc->y = y;
-		magicmouse_emit_buttons(msc, clicks & 3);
-		input_report_rel(input, REL_X, x);
-		input_report_rel(input, REL_Y, y);
-	} else if (input->id.product == USB_DEVICE_ID_APPLE_MAGICTRACKPAD) {
-		input_report_key(input, BTN_MOUSE, clicks & 1);
-		input_mt_report_pointer_emulation(input, true);
-	}
-	else /* USB_DEVICE_ID_APPLE_MAGICTRACKPAD2 */ {
-		input_mt_sync_frame(input);
-		input_report_key(input, BTN_MOUSE, clicks & 1);
-	}
+	/* Both halves of a double report were committed on their own. */
+	if (msc->frames && data[0] != DOUBLE_REPORT_ID)
+		magicmouse_frame_commit(msc,
+			input->id.product == USB_DEVICE_ID_APPLE_MAGICMOUSE ||
+			input->id.product == USB_DEVICE_ID_APPLE_MAGICMOUSE2 ?
+			clicks & 3 : clicks & 1, x, y);
+
+	if (input->id.product == USB_DEVICE_ID_APPLE_MAGICMOUSE ||
+		input->id.product == USB_DEVICE_ID_APPLE_MAGICMOUSE2) {
+		msc->x = x;
+		msc->y = y;
+		if (msc->cfg.tap_to_click)
+			magicmouse_tap_frame(msc, clicks & 3);
+		magicmouse_emit_buttons(msc, clicks & 3);
+		if (input->id.product == USB_DEVICE_ID_APPLE_MAGICMOUSE2)
+			magicmouse_predict_motion(msc, &x, &y);
+		input_report_rel(input, REL_X, x);
+		input_report_rel(input, REL_Y, y);
+		/* Mice track slots by key, and a slot is only handed out
+		 * again after the frame that released it has ended.
+		 */
+		input_mt_sync_frame(input);
+	} else if (input->id.product == USB_DEVICE_ID_APPLE_MAGICTRACKPAD) {
+		input_report_key(input, BTN_MOUSE, clicks & 1);
+		input_mt_report_pointer_emulation(input, true);
+	}
+	else /* USB_DEVICE_ID_APPLE_MAGICTRACKPAD2 */ {
+		input_mt_sync_frame(input);
+		input_report_key(input, BTN_MOUSE, clicks & 1);
+	}
+
+	input_sync(input);
+	return 1;
+}
+
+/* Report thread for threaded mode: drains the ring and does all decoding
+ * and input reporting outside of the transport receive path.
+ */
+static int magicmouse_report_thread(void *data)
+{
+	struct magicmouse_sc *msc = data;
+	struct magicmouse_ring *ring = msc->ring;
+	struct magicmouse_report_slot *slot;
+	unsigned long flags;
+	unsigned int tail;
+	u64 delay;
+
+	while (!kthread_should_stop()) {
+		wait_event_interruptible(msc->ring_wait,
+			smp_load_acquire(&ring->head) != ring->tail ||
+			kthread_should_stop());
+
+		tail = ring->tail;
+		while (tail != smp_load_acquire(&ring->head)) {
+			slot = &ring->slot[tail % REPORT_RING_SIZE];
+
+			delay = ktime_to_ns(ktime_sub(ktime_get(), slot->queued));
+			WRITE_ONCE(ring->delay_sum_ns, ring->delay_sum_ns + delay);
+			if (delay > ring->delay_max_ns)
+				WRITE_ONCE(ring->delay_max_ns, delay);
+			WRITE_ONCE(ring->handled, ring->handled + 1);
+
+			spin_lock_irqsave(&msc->lock, flags);
+			if (!msc->removing)
+				magicmouse_handle_report(msc->hdev, NULL,
+							 slot->data, slot->size);
+			spin_unlock_irqrestore(&msc->lock, flags);
+
+			smp_store_release(&ring->tail, ++tail);
+		}
+	}
+
+	return 0;
+}
+
+/* Copy a report into the ring for the report thread. Only the reports
+ * magicmouse_handle_report() decodes are queued; anything else is left to
+ * the HID core as before.
+ */
+static int magicmouse_queue_report(struct magicmouse_sc *msc, u8 *data,
+		int size)
+{
+	struct magicmouse_ring *ring = msc->ring;
+	struct magicmouse_report_slot *slot;
+	unsigned int head = ring->head;
+
+	switch (data[0]) {
+	case TRACKPAD_REPORT_ID:
+	case TRACKPAD2_BT_REPORT_ID:
+	case TRACKPAD2_USB_REPORT_ID:
+	case MOUSE_REPORT_ID:
+	case MOUSE2_REPORT_ID:
+	case DOUBLE_REPORT_ID:
+		break;
+	default:
+		return 0;
+	}
+
+	if (size > REPORT_MAX_SIZE) {
+		hid_warn_ratelimited(msc->hdev,
+				     "report too large for ring (%d)\n", size);
+		return 1;
+	}
+
+	if (head - smp_load_acquire(&ring->tail) >= REPORT_RING_SIZE) {
+		ring->dropped++;
+		hid_warn_ratelimited(msc->hdev,
+				     "report thread behind, %lu reports dropped\n",
+				     ring->dropped);
+		return 1;
+	}
+
+	slot = &ring->slot[head % REPORT_RING_SIZE];
+	memcpy(slot->data, data, size);
+	slot->size = size;
+	slot->queued = ktime_get();
+	smp_store_release(&ring->head, head + 1);
+
+	wake_up_interruptible(&msc->ring_wait);
+	return 1;
+}
+
+/* The battery report carries status flags in data[1], bit 1 set while
+ * the charging cable is connected, and the capacity in percent in data[2].
+ */
+static void magicmouse_battery_report(struct magicmouse_sc *msc, u8 *data,
+		int size)
+{
+	int capacity, status;
+
+	if (!msc->battery || size < 3)
+		return;
+
+	capacity = clamp_t(int, data[2], 0, 100);
+	if (data[1] & 0x02)
+		status = capacity == 100 ? POWER_SUPPLY_STATUS_FULL :
+			 POWER_SUPPLY_STATUS_CHARGING;
+	else
+		status = POWER_SUPPLY_STATUS_DISCHARGING;
+
+	if (capacity == READ_ONCE(msc->battery_capacity) &&
+	    status == READ_ONCE(msc->battery_status))
+		return;
+
+	WRITE_ONCE(msc->battery_capacity, capacity);
+	WRITE_ONCE(msc->battery_status, status);
+	power_supply_changed(msc->battery);
+}
+
+/* Battery queries ride on reports the device sends anyway: an idle device
+ * is never woken up for one, and at most one query is issued per
+ * battery_interval_s.
+ */
+static void magicmouse_battery_poll(struct magicmouse_sc *msc)
+{
+	if (!msc->battery || READ_ONCE(msc->removing) ||
+	    !time_after_eq(jiffies, msc->battery_next))
+		return;
+
+	msc->battery_next = jiffies + msc->cfg.battery_interval_s * HZ;
+	queue_work(magicmouse_wq, &msc->battery_work);
+}
+
+static void magicmouse_battery_work(struct work_struct *work)
+{
+	struct magicmouse_sc *msc =
+		container_of(work, struct magicmouse_sc, battery_work);
+
+	if (!READ_ONCE(msc->removing))
+		hid_hw_request(msc->hdev, msc->battery_report,
+			       HID_REQ_GET_REPORT);
+}
+
+/* With HID-BPF, data and size are what the attached hid_device_event
+ * programs left of the report, so everything below must validate them as
+ * if they came from the device.
+ */
+static int magicmouse_raw_event(struct hid_device *hdev,
+		struct hid_report *report, u8 *data, int size)
+{
+	struct magicmouse_sc *msc = hid_get_drvdata(hdev);
+	unsigned long flags;
+	int ret;
+
+	if (data[0] == BATTERY_REPORT_ID) {
+		magicmouse_battery_report(msc, data, size);
+		return 0;
+	}
+	magicmouse_battery_poll(msc);
+
+	if (msc->ring)
+		return magicmouse_queue_report(msc, data, size);
 
-	input_sync(input);
-	return 1;
+	spin_lock_irqsave(&msc->lock, flags);
+	ret = magicmouse_handle_report(hdev, report, data, size);
+	spin_unlock_irqrestore(&msc->lock, flags);
+
+	return ret;
 }
 
 static int magicmouse_event(struct hid_device *hdev, struct hid_field *field,
@@ -730,35 +2170,63 @@ static int magicmouse_event(struct hid_device *hdev, struct hid_field *field,
 		// magic_mouse_raw_event has done all the work. Skip hidinput.
 		//
 		// Specifically, hidinput may modify BTN_LEFT and BTN_RIGHT,
-		// breaking emulate_3button.
+		// breaking msc->cfg.emulate_3button.
 		return 1;
 	}
 	return 0;
 }
 
+/* Largest number of events one frame can carry: for every slot a slot
+ * switch plus each advertised MT axis, and once per frame every key,
+ * relative axis and single-touch axis. Keeps evdev from resizing its
+ * buffer or dropping a full trackpad frame.
+ */
+static int magicmouse_events_per_packet(struct input_dev *input, int slots)
+{
+	int per_touch = 0, per_frame, code;
+
+	for (code = ABS_MT_SLOT; code < ABS_CNT; code++)
+		if (test_bit(code, input->absbit))
+			per_touch++;
+	if (test_bit(MSC_RAW, input->mscbit))
+		per_touch++;
+
+	per_frame = bitmap_weight(input->keybit, KEY_CNT) +
+		    bitmap_weight(input->relbit, REL_CNT) +
+		    bitmap_weight(input->absbit, ABS_MT_SLOT);
+
+	return slots * per_touch + per_frame;
+}
+
 static int magicmouse_setup_input(struct input_dev *input, struct hid_device *hdev)
 {
+	struct magicmouse_sc *msc = hid_get_drvdata(hdev);
 	int error;
 	int mt_flags = 0;
+	int slots = MAX_TOUCHES;
 
 	__set_bit(EV_KEY, input->evbit);
 
 	if (input->id.product == USB_DEVICE_ID_APPLE_MAGICMOUSE ||
 		input->id.product == USB_DEVICE_ID_APPLE_MAGICMOUSE2) {
+		/* The emulated middle button, navigation keys and wheel
+		 * are advertised even when switched off, so that they can
+		 * be switched on in sysfs while the device is bound.
+		 */
 		__set_bit(BTN_LEFT, input->keybit);
 		__set_bit(BTN_RIGHT, input->keybit);
-		if (emulate_3button)
-			__set_bit(BTN_MIDDLE, input->keybit);
+		__set_bit(BTN_MIDDLE, input->keybit);
+		__set_bit(KEY_BACK, input->keybit);
+		__set_bit(KEY_FORWARD, input->keybit);
 
 		__set_bit(EV_REL, input->evbit);
 		__set_bit(REL_X, input->relbit);
 		__set_bit(REL_Y, input->relbit);
-		if (emulate_scroll_wheel) {
-			__set_bit(REL_WHEEL, input->relbit);
-			__set_bit(REL_HWHEEL, input->relbit);
-			__set_bit(REL_WHEEL_HI_RES, input->relbit);
-			__set_bit(REL_HWHEEL_HI_RES, input->relbit);
-		}
+		slots = MOUSE_MT_SLOTS;
+		__set_bit(REL_WHEEL, input->relbit);
+		__set_bit(REL_HWHEEL, input->relbit);
+		__set_bit(REL_WHEEL_HI_RES, input->relbit);
+		__set_bit(REL_HWHEEL_HI_RES, input->relbit);
 	} else if (input->id.product == USB_DEVICE_ID_APPLE_MAGICTRACKPAD){
 		/* input->keybit is initialized with incorrect button info
 		 * for Magic Trackpad. There really is only one physical
@@ -799,7 +2267,7 @@ static int magicmouse_setup_input(struct input_dev *input, struct hid_device *hd
 
 	__set_bit(EV_ABS, input->evbit);
 
-	error = input_mt_init_slots(input, MAX_TOUCHES, mt_flags);
+	error = input_mt_init_slots(input, slots, mt_flags);
 	if (error)
 		return error;
 	input_set_abs_params(input, ABS_MT_TOUCH_MAJOR, 0, 255 << 2,
@@ -863,14 +2331,14 @@ static int magicmouse_setup_input(struct input_dev *input, struct hid_device *hd
 				  TRACKPAD2_RES_Y);
 	}
 
-	input_set_events_per_packet(input, 60);
-
-	if (report_undeciphered &&
-	    input->id.product != USB_DEVICE_ID_APPLE_MAGICTRACKPAD2) {
+	if (input->id.product != USB_DEVICE_ID_APPLE_MAGICTRACKPAD2) {
 		__set_bit(EV_MSC, input->evbit);
 		__set_bit(MSC_RAW, input->mscbit);
 	}
 
+	input_set_events_per_packet(input,
+		magicmouse_events_per_packet(input, slots));
+
 	return 0;
 }
 
@@ -912,15 +2380,576 @@ static int magicmouse_input_configured(struct hid_device *hdev,
 
 
 
-static int magicmouse_enable_multitouch(struct hid_device *hdev)
+#define MAGICMOUSE_CONFIG_ATTR(_name, _min, _max)			\
+static ssize_t _name##_show(struct device *dev,				\
+		struct device_attribute *attr, char *buf)			\
+{									\
+	struct magicmouse_sc *msc = hid_get_drvdata(to_hid_device(dev));	\
+									\
+	return sprintf(buf, "%d\n", (int)msc->cfg._name);		\
+}									\
+									\
+static ssize_t _name##_store(struct device *dev,			\
+		struct device_attribute *attr, const char *buf, size_t count)	\
+{									\
+	struct magicmouse_sc *msc = hid_get_drvdata(to_hid_device(dev));	\
+	int val;							\
+									\
+	if (kstrtoint(buf, 0, &val) || val < (_min) || val > (_max))	\
+		return -EINVAL;						\
+	msc->cfg._name = val;						\
+	return count;							\
+}									\
+static DEVICE_ATTR_RW(_name)
+
+MAGICMOUSE_CONFIG_ATTR(emulate_3button, 0, 1);
+MAGICMOUSE_CONFIG_ATTR(middle_click_3finger, 0, 1);
+MAGICMOUSE_CONFIG_ATTR(emulate_scroll_wheel, 0, 1);
+MAGICMOUSE_CONFIG_ATTR(stop_scroll_while_moving, 0, 1);
+MAGICMOUSE_CONFIG_ATTR(stop_scroll_threshold, 0, 4096);
+MAGICMOUSE_CONFIG_ATTR(stop_scroll_holdoff_ms, 0, 10000);
+MAGICMOUSE_CONFIG_ATTR(scroll_speed, 0, 63);
+MAGICMOUSE_CONFIG_ATTR(scroll_delay_pos_x, 0, 4096);
+MAGICMOUSE_CONFIG_ATTR(scroll_delay_pos_y, 0, 4096);
+MAGICMOUSE_CONFIG_ATTR(scroll_acceleration, 0, 1);
+MAGICMOUSE_CONFIG_ATTR(scroll_kinetic, 0, 1);
+MAGICMOUSE_CONFIG_ATTR(scroll_kinetic_decay, 1, 99);
+MAGICMOUSE_CONFIG_ATTR(scroll_coalesce_us, 0, 100000);
+MAGICMOUSE_CONFIG_ATTR(swipe_navigation, 0, 1);
+MAGICMOUSE_CONFIG_ATTR(swipe_distance, 0, 4096);
+MAGICMOUSE_CONFIG_ATTR(swipe_time_ms, 0, 10000);
+MAGICMOUSE_CONFIG_ATTR(tap_time_ms, 0, 10000);
+MAGICMOUSE_CONFIG_ATTR(tap_double_ms, 0, 10000);
+MAGICMOUSE_CONFIG_ATTR(tap_travel, 0, 4096);
+MAGICMOUSE_CONFIG_ATTR(jitter_threshold, 0, 64);
+MAGICMOUSE_CONFIG_ATTR(jitter_smoothing, 0, 90);
+MAGICMOUSE_CONFIG_ATTR(pointer_predict, 0, 1);
+MAGICMOUSE_CONFIG_ATTR(pointer_predict_us, 0, 50000);
+MAGICMOUSE_CONFIG_ATTR(pointer_predict_damping, 0, 95);
+MAGICMOUSE_CONFIG_ATTR(battery_interval_s, 10, 3600);
+MAGICMOUSE_CONFIG_ATTR(report_undeciphered, 0, 1);
+MAGICMOUSE_CONFIG_ATTR(palm_major, 0, 256);
+MAGICMOUSE_CONFIG_ATTR(palm_size, 0, 64);
+MAGICMOUSE_CONFIG_ATTR(thumb_ratio, THUMB_RATIO_ONE, 16 * THUMB_RATIO_ONE);
+MAGICMOUSE_CONFIG_ATTR(thumb_angle, 0, 33);
+MAGICMOUSE_CONFIG_ATTR(thumb_zone, 0, 4096);
+
+static ssize_t scroll_accel_curve_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct magicmouse_sc *msc = hid_get_drvdata(to_hid_device(dev));
+	unsigned long flags;
+	int len;
+
+	spin_lock_irqsave(&msc->lock, flags);
+	len = magicmouse_curve_format(msc->curve, buf);
+	spin_unlock_irqrestore(&msc->lock, flags);
+
+	return len;
+}
+
+static ssize_t scroll_accel_curve_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct magicmouse_sc *msc = hid_get_drvdata(to_hid_device(dev));
+	struct magicmouse_curve *curve;
+	unsigned long flags;
+	int ret;
+
+	ret = magicmouse_curve_parse(buf, &curve);
+	if (ret)
+		return ret;
+
+	spin_lock_irqsave(&msc->lock, flags);
+	swap(msc->curve, curve);
+	spin_unlock_irqrestore(&msc->lock, flags);
+	kfree(curve);
+
+	return count;
+}
+static DEVICE_ATTR_RW(scroll_accel_curve);
+
+static ssize_t tap_to_click_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct magicmouse_sc *msc = hid_get_drvdata(to_hid_device(dev));
+
+	return sprintf(buf, "%d\n", (int)msc->cfg.tap_to_click);
+}
+
+/* Switching tap to click off also drops a tap in progress, so that no
+ * button stays held by a recognizer that no longer runs.
+ */
+static ssize_t tap_to_click_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct magicmouse_sc *msc = hid_get_drvdata(to_hid_device(dev));
+	unsigned long flags;
+	int val;
+
+	if (kstrtoint(buf, 0, &val) || val < 0 || val > 1)
+		return -EINVAL;
+
+	spin_lock_irqsave(&msc->lock, flags);
+	msc->cfg.tap_to_click = val;
+	spin_unlock_irqrestore(&msc->lock, flags);
+	if (val)
+		return count;
+
+	hrtimer_cancel(&msc->tap_timer);
+
+	spin_lock_irqsave(&msc->lock, flags);
+	if (!msc->cfg.tap_to_click) {
+		if (msc->tap_buttons) {
+			magicmouse_tap_press(msc, 0);
+			input_sync(msc->input);
+		}
+		msc->tap_state = TAP_IDLE;
+		msc->tap_starts = 0;
+		msc->tap_moved = false;
+	}
+	spin_unlock_irqrestore(&msc->lock, flags);
+
+	return count;
+}
+static DEVICE_ATTR_RW(tap_to_click);
+
+/* The zone map is written as ZONE_ROWS rows of ZONE_COLS cells, top row
+ * first, whitespace ignored. Lowercase cells allow scrolling, uppercase
+ * ones do not:
+ *   l/L left click   r/R right click   m/M middle click
+ *   .   no change    N   no scrolling  X   contact ignored
+ * An ignored contact is handled as lifted for as long as it stays in
+ * an X cell. Writing an empty map restores the default middle button
+ * interval.
+ */
+static const char magicmouse_zone_chars[] = ".NlLrRmMX";
+static const u8 magicmouse_zone_flags[] = {
+	0, ZONE_NO_SCROLL, 1, 1 | ZONE_NO_SCROLL, 2, 2 | ZONE_NO_SCROLL,
+	4, 4 | ZONE_NO_SCROLL, ZONE_IGNORE | ZONE_NO_SCROLL,
+};
+
+static ssize_t zone_map_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct magicmouse_sc *msc = hid_get_drvdata(to_hid_device(dev));
+	int row, col, ii, len = 0;
+
+	if (!msc->zone_map_set)
+		return 0;
+
+	for (row = 0; row < ZONE_ROWS; row++) {
+		for (col = 0; col < ZONE_COLS; col++) {
+			for (ii = 0; ii < ARRAY_SIZE(magicmouse_zone_flags); ii++)
+				if (magicmouse_zone_flags[ii] ==
+				    msc->zone_map[row][col])
+					break;
+			buf[len++] = magicmouse_zone_chars[ii];
+		}
+		buf[len++] = '\n';
+	}
+
+	return len;
+}
+
+static ssize_t zone_map_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct magicmouse_sc *msc = hid_get_drvdata(to_hid_device(dev));
+	u8 map[ZONE_ROWS][ZONE_COLS];
+	unsigned long flags;
+	size_t ii;
+	int cells = 0;
+
+	for (ii = 0; ii < count; ii++) {
+		const char *c;
+
+		if (isspace(buf[ii]))
+			continue;
+
+		c = strchr(magicmouse_zone_chars, buf[ii]);
+		if (!c || !*c || cells == ZONE_ROWS * ZONE_COLS)
+			return -EINVAL;
+
+		map[cells / ZONE_COLS][cells % ZONE_COLS] =
+			magicmouse_zone_flags[c - magicmouse_zone_chars];
+		cells++;
+	}
+
+	if (cells != 0 && cells != ZONE_ROWS * ZONE_COLS)
+		return -EINVAL;
+
+	spin_lock_irqsave(&msc->lock, flags);
+	memcpy(msc->zone_map, map, sizeof(map));
+	msc->zone_map_set = cells != 0;
+	spin_unlock_irqrestore(&msc->lock, flags);
+
+	return count;
+}
+static DEVICE_ATTR_RW(zone_map);
+
+static struct attribute *magicmouse_attrs[] = {
+	&dev_attr_emulate_3button.attr,
+	&dev_attr_middle_click_3finger.attr,
+	&dev_attr_emulate_scroll_wheel.attr,
+	&dev_attr_stop_scroll_while_moving.attr,
+	&dev_attr_stop_scroll_threshold.attr,
+	&dev_attr_stop_scroll_holdoff_ms.attr,
+	&dev_attr_scroll_speed.attr,
+	&dev_attr_scroll_delay_pos_x.attr,
+	&dev_attr_scroll_delay_pos_y.attr,
+	&dev_attr_scroll_acceleration.attr,
+	&dev_attr_scroll_accel_curve.attr,
+	&dev_attr_scroll_kinetic.attr,
+	&dev_attr_scroll_kinetic_decay.attr,
+	&dev_attr_scroll_coalesce_us.attr,
+	&dev_attr_swipe_navigation.attr,
+	&dev_attr_swipe_distance.attr,
+	&dev_attr_swipe_time_ms.attr,
+	&dev_attr_tap_to_click.attr,
+	&dev_attr_tap_time_ms.attr,
+	&dev_attr_tap_double_ms.attr,
+	&dev_attr_tap_travel.attr,
+	&dev_attr_jitter_threshold.attr,
+	&dev_attr_jitter_smoothing.attr,
+	&dev_attr_pointer_predict.attr,
+	&dev_attr_pointer_predict_us.attr,
+	&dev_attr_pointer_predict_damping.attr,
+	&dev_attr_battery_interval_s.attr,
+	&dev_attr_report_undeciphered.attr,
+	&dev_attr_palm_major.attr,
+	&dev_attr_palm_size.attr,
+	&dev_attr_thumb_ratio.attr,
+	&dev_attr_thumb_angle.attr,
+	&dev_attr_thumb_zone.attr,
+	&dev_attr_zone_map.attr,
+	NULL
+};
+
+static const struct attribute_group magicmouse_attr_group = {
+	.attrs = magicmouse_attrs,
+};
+
+/* Take the device configuration from the module parameters, so devices
+ * never read shared mutable state while handling reports. The parameters
+ * are read-only once the module is loaded; a bound device is tuned through
+ * its own sysfs attributes instead. Classifier
+ * thresholds and the zone map area are per model: trackpad contacts are
+ * larger and thumbs rest along the bottom edge rather than the sides.
+ */
+static int magicmouse_init_config(struct magicmouse_sc *msc,
+		const struct hid_device_id *id)
+{
+	struct magicmouse_config *cfg = &msc->cfg;
+
+	cfg->emulate_3button = emulate_3button;
+	cfg->middle_click_3finger = middle_click_3finger;
+	cfg->emulate_scroll_wheel = emulate_scroll_wheel;
+	cfg->stop_scroll_while_moving = stop_scroll_while_moving;
+	cfg->stop_scroll_threshold = stop_scroll_threshold;
+	cfg->stop_scroll_holdoff_ms = stop_scroll_holdoff_ms;
+	cfg->scroll_speed = scroll_speed;
+	cfg->scroll_delay_pos_x = scroll_delay_pos_x;
+	cfg->scroll_delay_pos_y = scroll_delay_pos_y;
+	cfg->scroll_acceleration = scroll_acceleration;
+	cfg->scroll_kinetic = scroll_kinetic;
+	cfg->scroll_kinetic_decay = scroll_kinetic_decay;
+	cfg->scroll_coalesce_us = scroll_coalesce_us;
+	cfg->swipe_navigation = swipe_navigation;
+	cfg->swipe_distance = swipe_distance;
+	cfg->swipe_time_ms = swipe_time_ms;
+	cfg->tap_to_click = tap_to_click;
+	cfg->tap_time_ms = tap_time_ms;
+	cfg->tap_double_ms = tap_double_ms;
+	cfg->tap_travel = tap_travel;
+	cfg->jitter_threshold = jitter_threshold;
+	cfg->jitter_smoothing = jitter_smoothing;
+	cfg->pointer_predict = pointer_predict;
+	cfg->pointer_predict_us = pointer_predict_us;
+	cfg->pointer_predict_damping = pointer_predict_damping;
+	cfg->report_undeciphered = report_undeciphered;
+	cfg->battery_interval_s = battery_interval_s;
+
+	if (scroll_curve) {
+		msc->curve = kmemdup(scroll_curve, sizeof(*scroll_curve),
+				     GFP_KERNEL);
+		if (!msc->curve)
+			return -ENOMEM;
+	}
+
+	if (id->product == USB_DEVICE_ID_APPLE_MAGICMOUSE ||
+	    id->product == USB_DEVICE_ID_APPLE_MAGICMOUSE2) {
+		msc->cfg.palm_major = 100;
+		msc->cfg.palm_size = 32;
+		msc->cfg.thumb_zone = 250;
+		msc->zone_min_x = MOUSE_MIN_X;
+		msc->zone_min_y = MOUSE_MIN_Y;
+		msc->zone_width = MOUSE_MAX_X - MOUSE_MIN_X + 1;
+		msc->zone_height = MOUSE_MAX_Y - MOUSE_MIN_Y + 1;
+	} else if (id->product == USB_DEVICE_ID_APPLE_MAGICTRACKPAD) {
+		msc->cfg.palm_major = 160;
+		msc->cfg.palm_size = 48;
+		msc->cfg.thumb_zone = 600;
+		msc->zone_min_x = TRACKPAD_MIN_X;
+		msc->zone_min_y = TRACKPAD_MIN_Y;
+		msc->zone_width = TRACKPAD_MAX_X - TRACKPAD_MIN_X + 1;
+		msc->zone_height = TRACKPAD_MAX_Y - TRACKPAD_MIN_Y + 1;
+	} else {
+		msc->cfg.palm_major = 160;
+		msc->cfg.palm_size = 48;
+		msc->cfg.thumb_zone = 600;
+		msc->zone_min_x = TRACKPAD2_MIN_X;
+		msc->zone_min_y = TRACKPAD2_MIN_Y;
+		msc->zone_width = TRACKPAD2_MAX_X - TRACKPAD2_MIN_X + 1;
+		msc->zone_height = TRACKPAD2_MAX_Y - TRACKPAD2_MIN_Y + 1;
+	}
+	msc->cfg.thumb_ratio = 2 * THUMB_RATIO_ONE;
+	msc->cfg.thumb_angle = 24;
+
+	return 0;
+}
+
+static enum power_supply_property magicmouse_battery_props[] = {
+	POWER_SUPPLY_PROP_PRESENT,
+	POWER_SUPPLY_PROP_CAPACITY,
+	POWER_SUPPLY_PROP_STATUS,
+	POWER_SUPPLY_PROP_SCOPE,
+	POWER_SUPPLY_PROP_MODEL_NAME,
+};
+
+/* Served from the values cached by magicmouse_battery_report(), so reading
+ * the power supply never causes device traffic.
+ */
+static int magicmouse_battery_get_property(struct power_supply *psy,
+		enum power_supply_property psp, union power_supply_propval *val)
+{
+	struct magicmouse_sc *msc = power_supply_get_drvdata(psy);
+
+	switch (psp) {
+	case POWER_SUPPLY_PROP_PRESENT:
+		val->intval = 1;
+		break;
+	case POWER_SUPPLY_PROP_CAPACITY:
+		val->intval = READ_ONCE(msc->battery_capacity);
+		if (val->intval < 0)
+			return -ENODATA;
+		break;
+	case POWER_SUPPLY_PROP_STATUS:
+		val->intval = READ_ONCE(msc->battery_status);
+		break;
+	case POWER_SUPPLY_PROP_SCOPE:
+		val->intval = POWER_SUPPLY_SCOPE_DEVICE;
+		break;
+	case POWER_SUPPLY_PROP_MODEL_NAME:
+		val->strval = msc->hdev->name;
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+/* Register a power supply for models with a rechargeable battery. A
+ * missing battery report or a failed registration only costs the battery
+ * level, so neither fails the probe.
+ */
+static void magicmouse_setup_battery(struct magicmouse_sc *msc)
+{
+	struct hid_device *hdev = msc->hdev;
+	struct power_supply_config psy_cfg = { .drv_data = msc, };
+	struct power_supply *battery;
+	const char *name;
+
+	if (hdev->product != USB_DEVICE_ID_APPLE_MAGICMOUSE2 &&
+	    hdev->product != USB_DEVICE_ID_APPLE_MAGICTRACKPAD2)
+		return;
+
+#ifdef CONFIG_HID_BATTERY_STRENGTH
+	/* hid-input already registered one from the descriptor's battery
+	 * strength usage; a second supply would show the device twice.
+	 */
+	if (hdev->battery)
+		return;
+#endif
+
+	msc->battery_report =
+		hdev->report_enum[HID_INPUT_REPORT].report_id_hash[BATTERY_REPORT_ID];
+	if (!msc->battery_report)
+		return;
+
+	name = devm_kasprintf(&hdev->dev, GFP_KERNEL, "magicmouse-%s-battery",
+			      strlen(hdev->uniq) ? hdev->uniq :
+			      dev_name(&hdev->dev));
+	if (!name)
+		return;
+
+	msc->battery_capacity = -1;
+	msc->battery_status = POWER_SUPPLY_STATUS_UNKNOWN;
+	msc->battery_desc.name = name;
+	msc->battery_desc.type = POWER_SUPPLY_TYPE_BATTERY;
+	msc->battery_desc.properties = magicmouse_battery_props;
+	msc->battery_desc.num_properties = ARRAY_SIZE(magicmouse_battery_props);
+	msc->battery_desc.get_property = magicmouse_battery_get_property;
+
+	battery = devm_power_supply_register(&hdev->dev, &msc->battery_desc,
+					     &psy_cfg);
+	if (IS_ERR(battery)) {
+		hid_warn(hdev, "unable to register battery (%ld)\n",
+			 PTR_ERR(battery));
+		return;
+	}
+	power_supply_powers(battery, &hdev->dev);
+
+	msc->battery_next = jiffies + msc->cfg.battery_interval_s * HZ;
+	msc->battery = battery;
+	queue_work(magicmouse_wq, &msc->battery_work);
+}
+
+static void magicmouse_frames_free(struct kref *ref)
+{
+	struct magicmouse_frames *frames =
+		container_of(ref, struct magicmouse_frames, ref);
+
+	vfree(frames->ring);
+	kfree(frames);
+}
+
+static int magicmouse_frames_open(struct inode *inode, struct file *file)
+{
+	struct magicmouse_frames *frames = container_of(file->private_data,
+		struct magicmouse_frames, misc);
+	struct magicmouse_frames_reader *reader;
+
+	/* Read-only opens keep shared mappings from ever becoming writable. */
+	if (file->f_mode & FMODE_WRITE)
+		return -EPERM;
+
+	reader = kzalloc(sizeof(*reader), GFP_KERNEL);
+	if (!reader)
+		return -ENOMEM;
+
+	kref_get(&frames->ref);
+	reader->frames = frames;
+	reader->seen = smp_load_acquire(&frames->ring->head);
+	file->private_data = reader;
+
+	return nonseekable_open(inode, file);
+}
+
+static int magicmouse_frames_release(struct inode *inode, struct file *file)
+{
+	struct magicmouse_frames_reader *reader = file->private_data;
+
+	kref_put(&reader->frames->ref, magicmouse_frames_free);
+	kfree(reader);
+	return 0;
+}
+
+static __poll_t magicmouse_frames_poll(struct file *file, poll_table *wait)
+{
+	struct magicmouse_frames_reader *reader = file->private_data;
+	struct magicmouse_frames *frames = reader->frames;
+	u32 head;
+
+	poll_wait(file, &frames->wait, wait);
+
+	if (READ_ONCE(frames->dead))
+		return EPOLLHUP | EPOLLERR;
+
+	head = smp_load_acquire(&frames->ring->head);
+	if (head == reader->seen)
+		return 0;
+
+	reader->seen = head;
+	return EPOLLIN | EPOLLRDNORM;
+}
+
+static int magicmouse_frames_mmap(struct file *file,
+		struct vm_area_struct *vma)
+{
+	struct magicmouse_frames_reader *reader = file->private_data;
+
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+
+	return remap_vmalloc_range(vma, reader->frames->ring, vma->vm_pgoff);
+}
+
+static const struct file_operations magicmouse_frames_fops = {
+	.owner = THIS_MODULE,
+	.open = magicmouse_frames_open,
+	.release = magicmouse_frames_release,
+	.poll = magicmouse_frames_poll,
+	.mmap = magicmouse_frames_mmap,
+};
+
+/* The frame ring is an optional extra for low-latency consumers; the
+ * device works without it, so failures only warn.
+ */
+static void magicmouse_setup_frames(struct magicmouse_sc *msc)
+{
+	struct hid_device *hdev = msc->hdev;
+	struct magicmouse_frames *frames;
+	struct magicmouse_frame_ring *ring;
+	size_t offset = ALIGN(sizeof(*ring), L1_CACHE_BYTES);
+	unsigned long flags;
+	int ret;
+
+	if (!frame_ring)
+		return;
+
+	frames = kzalloc(sizeof(*frames), GFP_KERNEL);
+	if (!frames)
+		return;
+
+	frames->ring_size = PAGE_ALIGN(offset +
+		FRAME_RING_SIZE * sizeof(struct magicmouse_frame));
+	ring = vmalloc_user(frames->ring_size);
+	if (!ring) {
+		hid_warn(hdev, "unable to allocate frame ring\n");
+		kfree(frames);
+		return;
+	}
+
+	ring->magic = MAGICMOUSE_FRAME_MAGIC;
+	ring->frame_size = sizeof(struct magicmouse_frame);
+	ring->frame_count = FRAME_RING_SIZE;
+	ring->frames_offset = offset;
+	frames->ring = ring;
+	kref_init(&frames->ref);
+	init_waitqueue_head(&frames->wait);
+
+	snprintf(frames->name, sizeof(frames->name), "magicmouse-%s",
+		 dev_name(&hdev->dev));
+	frames->misc.minor = MISC_DYNAMIC_MINOR;
+	frames->misc.name = frames->name;
+	frames->misc.fops = &magicmouse_frames_fops;
+	frames->misc.parent = &hdev->dev;
+
+	ret = misc_register(&frames->misc);
+	if (ret) {
+		hid_warn(hdev, "unable to register frame ring device (%d)\n",
+			 ret);
+		kref_put(&frames->ref, magicmouse_frames_free);
+		return;
+	}
+
+	/* Reports may already be arriving. */
+	spin_lock_irqsave(&msc->lock, flags);
+	msc->frames = frames;
+	spin_unlock_irqrestore(&msc->lock, flags);
+}
+
+static int magicmouse_enable_multitouch(struct magicmouse_sc *msc)
 {
+	struct hid_device *hdev = msc->hdev;
 	const u8 *feature;
 	const u8 feature_mt[] = { 0xD7, 0x01 };
-	const u8 feature_mt_mouse2[] = { 0xF1, 0x02, 0x01 };
+	const u8 feature_mt_mouse2[] = MOUSE2_FEATURE_MT;
 	const u8 feature_mt_trackpad2_usb[] = { 0x02, 0x01 };
 	const u8 feature_mt_trackpad2_bt[] = { 0xF1, 0x02, 0x01 };
-	u8 *buf;
-	int ret;
+	u8 *buf = msc->mt_feature;
 	int feature_size;
 
 	if (hdev->product == USB_DEVICE_ID_APPLE_MAGICTRACKPAD2) {
@@ -939,25 +2968,114 @@ static int magicmouse_enable_multitouch(struct hid_device *hdev)
 		feature = feature_mt;
 	}
 
-	buf = kmemdup(feature, feature_size, GFP_KERNEL);
-	if (!buf)
-		return -ENOMEM;
+	/* The transport may modify the buffer, so refill it every attempt. */
+	memcpy(buf, feature, feature_size);
 
-	ret = hid_hw_raw_request(hdev, buf[0], buf, feature_size,
+	return hid_hw_raw_request(hdev, buf[0], buf, feature_size,
 				HID_FEATURE_REPORT, HID_REQ_SET_REPORT);
-	kfree(buf);
-	return ret;
 }
 
+/* Switch the device into multitouch mode off the probe path, so the
+ * pointer is usable while the request makes its round trip. The Magic
+ * Mouse 2 is retried with exponential backoff until it accepts, touch
+ * data shows up on its own, or the attempts run out.
+ */
 static void magicmouse_enable_mt_work(struct work_struct *work)
 {
 	struct magicmouse_sc *msc =
 		container_of(work, struct magicmouse_sc, work.work);
 	int ret;
 
-	ret = magicmouse_enable_multitouch(msc->hdev);
-	if (ret < 0)
+	if (READ_ONCE(msc->mt_active))
+		return;
+
+	ret = magicmouse_enable_multitouch(msc);
+	if (ret >= 0) {
+		magicmouse_mark_phase(msc, PHASE_MT_ENABLE);
+		return;
+	}
+
+	/*
+	 * Some devices repond with 'invalid report id' when feature
+	 * report switching it into multitouch mode is sent to it.
+	 *
+	 * This results in -EIO from the _raw low-level transport callback,
+	 * but there seems to be no other way of switching the mode.
+	 * Thus the super-ugly hacky success check below.
+	 */
+	if (ret == -EIO &&
+	    msc->hdev->product != USB_DEVICE_ID_APPLE_MAGICMOUSE2)
+		return;
+
+	if (ret != -EIO || ++msc->mt_attempts >= MT_ENABLE_ATTEMPTS) {
 		hid_err(msc->hdev, "unable to request touch data (%d)\n", ret);
+		return;
+	}
+
+	/* The first retry waits MT_ENABLE_DELAY_MS, each later one twice as
+	 * long up to MT_ENABLE_DELAY_MAX_MS.
+	 */
+	queue_delayed_work(magicmouse_wq, &msc->work,
+			   msecs_to_jiffies(msc->mt_delay_ms));
+	msc->mt_delay_ms = min_t(unsigned int, msc->mt_delay_ms * 2,
+				 MT_ENABLE_DELAY_MAX_MS);
+}
+
+static int magicmouse_timing_show(struct seq_file *s, void *unused)
+{
+	struct magicmouse_sc *msc = s->private;
+	int ii;
+
+	for (ii = 0; ii < PHASE_COUNT; ii++) {
+		if (msc->phase_ns[ii])
+			seq_printf(s, "%-12s %lld us\n", magicmouse_phase_names[ii],
+				   div_s64(msc->phase_ns[ii], NSEC_PER_USEC));
+		else
+			seq_printf(s, "%-12s -\n", magicmouse_phase_names[ii]);
+	}
+	seq_printf(s, "%-12s %d\n", "mt_retries", READ_ONCE(msc->mt_attempts));
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(magicmouse_timing);
+
+static int magicmouse_thread_delay_show(struct seq_file *s, void *unused)
+{
+	struct magicmouse_ring *ring = s->private;
+	unsigned long handled = READ_ONCE(ring->handled);
+
+	seq_printf(s, "reports %lu\ndropped %lu\n", handled,
+		   READ_ONCE(ring->dropped));
+	seq_printf(s, "avg     %llu us\nmax     %llu us\n",
+		   handled ? div64_ul(READ_ONCE(ring->delay_sum_ns), handled) /
+			     NSEC_PER_USEC : 0,
+		   div64_ul(READ_ONCE(ring->delay_max_ns), NSEC_PER_USEC));
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(magicmouse_thread_delay);
+
+static void magicmouse_init_state(struct magicmouse_sc *msc,
+		struct hid_device *hdev)
+{
+	msc->probe_start = ktime_get();
+	msc->scroll_accel = SCROLL_ACCEL_DEFAULT;
+	msc->motion_last = jiffies;
+	msc->motion_jiffies = jiffies;
+	msc->swipe_last = jiffies;
+	msc->hdev = hdev;
+	INIT_DELAYED_WORK(&msc->work, magicmouse_enable_mt_work);
+	INIT_WORK(&msc->battery_work, magicmouse_battery_work);
+	spin_lock_init(&msc->lock);
+	hrtimer_init(&msc->kinetic_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	msc->kinetic_timer.function = magicmouse_kinetic_timer;
+	hrtimer_init(&msc->coalesce_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	msc->coalesce_timer.function = magicmouse_coalesce_timer;
+	hrtimer_init(&msc->tap_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	msc->tap_timer.function = magicmouse_tap_timer;
+	hrtimer_init(&msc->predict_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	msc->predict_timer.function = magicmouse_predict_timer;
+	init_waitqueue_head(&msc->ring_wait);
 }
 
 static int magicmouse_probe(struct hid_device *hdev,
@@ -978,24 +3096,48 @@ static int magicmouse_probe(struct hid_device *hdev,
 		return -ENOMEM;
 	}
 
-	msc->scroll_accel = SCROLL_ACCEL_DEFAULT;
-	msc->hdev = hdev;
-	INIT_DEFERRABLE_WORK(&msc->work, magicmouse_enable_mt_work);
+	magicmouse_init_state(msc, hdev);
+
+	msc->mt_feature = devm_kmalloc(&hdev->dev, MT_FEATURE_MAX_SIZE,
+				       GFP_KERNEL);
+	if (!msc->mt_feature)
+		return -ENOMEM;
+
+	if (threaded) {
+		msc->ring = devm_kzalloc(&hdev->dev, sizeof(*msc->ring),
+					 GFP_KERNEL);
+		if (!msc->ring)
+			return -ENOMEM;
+
+		msc->worker = kthread_run(magicmouse_report_thread, msc,
+					  "magicmouse-%s", dev_name(&hdev->dev));
+		if (IS_ERR(msc->worker)) {
+			ret = PTR_ERR(msc->worker);
+			hid_err(hdev, "unable to start report thread (%d)\n", ret);
+			return ret;
+		}
+		set_user_nice(msc->worker, clamp(threaded_nice, -20, 19));
+	}
 
 	msc->quirks = id->driver_data;
+	ret = magicmouse_init_config(msc, id);
+	if (ret)
+		goto err_stop_worker;
 	hid_set_drvdata(hdev, msc);
 
 	ret = hid_parse(hdev);
 	if (ret) {
 		hid_err(hdev, "magicmouse hid parse failed\n");
-		return ret;
+		goto err_stop_worker;
 	}
+	magicmouse_mark_phase(msc, PHASE_PARSE);
 
 	ret = hid_hw_start(hdev, HID_CONNECT_DEFAULT);
 	if (ret) {
 		hid_err(hdev, "magicmouse hw start failed\n");
-		return ret;
+		goto err_stop_worker;
 	}
+	magicmouse_mark_phase(msc, PHASE_HW_START);
 
 	if (!msc->input) {
 		hid_err(hdev, "magicmouse input not registered\n");
@@ -1029,37 +3171,82 @@ static int magicmouse_probe(struct hid_device *hdev,
 		goto err_stop_hw;
 	}
 	report->size = 6;
+	magicmouse_mark_phase(msc, PHASE_REPORT);
 
-
-	/*
-	 * Some devices repond with 'invalid report id' when feature
-	 * report switching it into multitouch mode is sent to it.
-	 *
-	 * This results in -EIO from the _raw low-level transport callback,
-	 * but there seems to be no other way of switching the mode.
-	 * Thus the super-ugly hacky success check below.
-	 */
-	ret = magicmouse_enable_multitouch(hdev);
-	if (ret != -EIO && ret < 0) {
-		hid_err(hdev, "unable to request touch data (%d)\n", ret);
+	ret = sysfs_create_group(&hdev->dev.kobj, &magicmouse_attr_group);
+	if (ret) {
+		hid_err(hdev, "unable to create sysfs attributes (%d)\n", ret);
 		goto err_stop_hw;
 	}
-	if (ret == -EIO && id->product == USB_DEVICE_ID_APPLE_MAGICMOUSE2) {
-		schedule_delayed_work(&msc->work, msecs_to_jiffies(500));
-	}
 
+	magicmouse_setup_battery(msc);
+	magicmouse_setup_frames(msc);
+
+	msc->debugfs = debugfs_create_dir(dev_name(&hdev->dev),
+					  magicmouse_debugfs);
+	debugfs_create_file("probe_timing", 0444, msc->debugfs, msc,
+			    &magicmouse_timing_fops);
+	if (msc->ring)
+		debugfs_create_file("thread_delay", 0444, msc->debugfs,
+				    msc->ring, &magicmouse_thread_delay_fops);
+
+	msc->mt_delay_ms = MT_ENABLE_DELAY_MS;
+	queue_delayed_work(magicmouse_wq, &msc->work, 0);
+
+	magicmouse_mark_phase(msc, PHASE_PROBE);
 	return 0;
 err_stop_hw:
 	hid_hw_stop(hdev);
+err_stop_worker:
+	if (msc->worker)
+		kthread_stop(msc->worker);
+	kfree(msc->curve);
 	return ret;
 }
 
 static void magicmouse_remove(struct hid_device *hdev)
 {
 	struct magicmouse_sc *msc = hid_get_drvdata(hdev);
-	if (msc)
-		cancel_delayed_work_sync(&msc->work);
+	unsigned long flags;
+
+	sysfs_remove_group(&hdev->dev.kobj, &magicmouse_attr_group);
+	if (!msc) {
+		hid_hw_stop(hdev);
+		return;
+	}
+
+	/* Timers and the report thread stop reporting from here on, so
+	 * nothing touches the input device while it goes away.
+	 */
+	spin_lock_irqsave(&msc->lock, flags);
+	WRITE_ONCE(msc->removing, true);
+	spin_unlock_irqrestore(&msc->lock, flags);
+
+	debugfs_remove_recursive(msc->debugfs);
+	cancel_delayed_work_sync(&msc->work);
+	if (msc->worker)
+		kthread_stop(msc->worker);
 	hid_hw_stop(hdev);
+
+	/* No raw events arrive after hid_hw_stop(), so none can re-arm a
+	 * timer or queue another battery query.
+	 */
+	cancel_work_sync(&msc->battery_work);
+	hrtimer_cancel(&msc->kinetic_timer);
+	hrtimer_cancel(&msc->coalesce_timer);
+	hrtimer_cancel(&msc->tap_timer);
+	hrtimer_cancel(&msc->predict_timer);
+
+	/* Readers keep the ring until they close it; wake them to see the
+	 * device is gone.
+	 */
+	if (msc->frames) {
+		misc_deregister(&msc->frames->misc);
+		WRITE_ONCE(msc->frames->dead, true);
+		wake_up_interruptible(&msc->frames->wait);
+		kref_put(&msc->frames->ref, magicmouse_frames_free);
+	}
+	kfree(msc->curve);
 }
 
 static const struct hid_device_id magic_mice[] = {
@@ -1087,7 +3274,37 @@ static struct hid_driver magicmouse_driver = {
 	.input_mapping = magicmouse_input_mapping,
 	.input_configured = magicmouse_input_configured,
 };
-module_hid_driver(magicmouse_driver);
+
+static int __init magicmouse_init(void)
+{
+	int ret;
+
+	/* Deferred multitouch enables of many devices must not serialize
+	 * behind each other or behind unrelated work on the system queue.
+	 */
+	magicmouse_wq = alloc_workqueue("magicmouse", WQ_UNBOUND, 0);
+	if (!magicmouse_wq)
+		return -ENOMEM;
+
+	magicmouse_debugfs = debugfs_create_dir("magicmouse", NULL);
+
+	ret = hid_register_driver(&magicmouse_driver);
+	if (ret) {
+		debugfs_remove_recursive(magicmouse_debugfs);
+		destroy_workqueue(magicmouse_wq);
+	}
+	return ret;
+}
+module_init(magicmouse_init);
+
+static void __exit magicmouse_exit(void)
+{
+	hid_unregister_driver(&magicmouse_driver);
+	debugfs_remove_recursive(magicmouse_debugfs);
+	destroy_workqueue(magicmouse_wq);
+	kfree(scroll_curve);
+}
+module_exit(magicmouse_exit);
 
 MODULE_AUTHOR("Ricardo Rodrigues");
 MODULE_AUTHOR("John Chen");
@@ -1098,3 +3315,7 @@ MODULE_AUTHOR("Michael Poole");
 MODULE_DESCRIPTION("Magic Mouse 2 driver for Linux");
 
 MODULE_LICENSE("GPL");
+
+#if defined(MAGICMOUSE2_KUNIT_TEST) && IS_ENABLED(CONFIG_KUNIT)
+#include "hid-magicmouse2-test.c"
+#endif
@@ -0,0 +1,232 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ *   Apple "Magic" Wireless Mouse report layouts
+ *
+ *   Shared by the hid-magicmouse2 kernel driver and the userspace tools, so
+ *   both decode reports the same way. Only depends on <linux/types.h>,
+ *   which exists in the kernel and in the UAPI headers. HID-BPF programs
+ *   include it after vmlinux.h, which already provides the types.
+ */
+
+#ifndef __HID_MAGICMOUSE2_H
+#define __HID_MAGICMOUSE2_H
+
+#ifndef __VMLINUX_H__
+#include <linux/types.h>
+#endif
+
+#define TRACKPAD_REPORT_ID 0x28
+#define TRACKPAD2_USB_REPORT_ID 0x02
+#define TRACKPAD2_BT_REPORT_ID 0x31
+#define MOUSE_REPORT_ID    0x29
+#define MOUSE2_REPORT_ID   0x12
+#define MOUSE2_REQUEST_REPORT_ID   0xa1
+#define DOUBLE_REPORT_ID   0xf7
+#define BATTERY_REPORT_ID  0x90
+
+/* Feature report that switches a Magic Mouse 2 into multitouch mode. */
+#define MOUSE2_FEATURE_MT	{ 0xF1, 0x02, 0x01 }
+
+/* A Magic Mouse 2 report is a 14 byte header followed by one 8 byte
+ * record per touch.
+ */
+#define MOUSE2_HEADER_SIZE	14
+#define MOUSE2_TOUCH_SIZE	8
+#define MOUSE2_MAX_TOUCHES	15
+
+/* Contacts a Magic Mouse surface realistically carries at once. Further
+ * contacts still take part in scrolling and clicks but get no MT slot.
+ * Trackpads get a slot for every tracking ID.
+ */
+#define MOUSE_MT_SLOTS		5
+
+/* These definitions are not precise, but they're close enough.  (Bits
+ * 0x03 seem to indicate the aspect ratio of the touch, bits 0x70 seem
+ * to be some kind of bit mask -- 0x20 may be a near-field reading,
+ * and 0x40 is actual contact, and 0x10 may be a start/stop or change
+ * indication.)
+ */
+#define TOUCH_STATE_MASK  0xf0
+#define TOUCH_STATE_NONE  0x00
+#define TOUCH_STATE_START 0x30
+#define TOUCH_STATE_DRAG  0x40
+
+/* Touch surface information. Dimension is in hundredths of a mm, min and max
+ * are in units. */
+#define MOUSE_DIMENSION_X (float)9056
+#define MOUSE_MIN_X -1100
+#define MOUSE_MAX_X 1258
+#define MOUSE_RES_X ((MOUSE_MAX_X - MOUSE_MIN_X) / (MOUSE_DIMENSION_X / 100))
+#define MOUSE_DIMENSION_Y (float)5152
+#define MOUSE_MIN_Y -1589
+#define MOUSE_MAX_Y 2047
+#define MOUSE_RES_Y ((MOUSE_MAX_Y - MOUSE_MIN_Y) / (MOUSE_DIMENSION_Y / 100))
+
+#define TRACKPAD_DIMENSION_X (float)13000
+#define TRACKPAD_MIN_X -2909
+#define TRACKPAD_MAX_X 3167
+#define TRACKPAD_RES_X \
+	((TRACKPAD_MAX_X - TRACKPAD_MIN_X) / (TRACKPAD_DIMENSION_X / 100))
+#define TRACKPAD_DIMENSION_Y (float)11000
+#define TRACKPAD_MIN_Y -2456
+#define TRACKPAD_MAX_Y 2565
+#define TRACKPAD_RES_Y \
+	((TRACKPAD_MAX_Y - TRACKPAD_MIN_Y) / (TRACKPAD_DIMENSION_Y / 100))
+
+#define TRACKPAD2_DIMENSION_X (float)16000
+#define TRACKPAD2_MIN_X -3678
+#define TRACKPAD2_MAX_X 3934
+#define TRACKPAD2_RES_X \
+	((TRACKPAD2_MAX_X - TRACKPAD2_MIN_X) / (TRACKPAD2_DIMENSION_X / 100))
+#define TRACKPAD2_DIMENSION_Y (float)11490
+#define TRACKPAD2_MIN_Y -2478
+#define TRACKPAD2_MAX_Y 2587
+#define TRACKPAD2_RES_Y \
+	((TRACKPAD2_MAX_Y - TRACKPAD2_MIN_Y) / (TRACKPAD2_DIMENSION_Y / 100))
+
+/**
+ * struct magicmouse_touch - One decoded touch record.
+ * @id: Tracking ID of the contact, 0 to 15.
+ * @x: Horizontal position in units.
+ * @y: Vertical position in units, inverted so it grows downwards.
+ * @size: Contact size, 0 to 63.
+ * @orientation: Ellipse orientation, -32 to 31.
+ * @touch_major: Major axis of the contact ellipse.
+ * @touch_minor: Minor axis of the contact ellipse.
+ * @state: One of the TOUCH_STATE_* values.
+ */
+struct magicmouse_touch {
+	int id;
+	int x;
+	int y;
+	int size;
+	int orientation;
+	int touch_major;
+	int touch_minor;
+	int state;
+};
+
+/* tdata is 8 bytes per finger detected.
+ * tdata[0] (lsb of x) and least sig 4bits of tdata[1] (msb of x)
+ *          are x position of touch on touch surface.
+ * tdata[1] most sig 4bits (lsb of y) and and tdata[2] (msb of y)
+ *          are y position of touch on touch surface.
+ * tdata[1] bits look like [y y y y x x x x]
+ * tdata[3] touch major axis of ellipse of finger detected
+ * tdata[4] touch minor axis of ellipse of finger detected
+ * tdata[5] contains 6bits of size info (lsb) and the two msb of tdata[5]
+ *          are the lsb of id: [id id size size size size size size]
+ * tdata[6] 2 lsb bits of tdata[6] are the msb of id and 6msb of tdata[6]
+ *          are the orientation of the touch. [o o o o o o id id]
+ * tdata[7] 4 msb are state. 4lsb are unknown.
+ *
+ * [ x x x x x x x x ]
+ * [ y y y y x x x x ]
+ * [ y y y y y y y y ]
+ * [touch major      ]
+ * [touch minor      ]
+ * [id id s s s s s s]
+ * [o o o o o o id id]
+ * [s s s s | unknown]
+ */
+static inline void magicmouse_decode_touch(const __u8 *tdata,
+		struct magicmouse_touch *touch)
+{
+	touch->id = (tdata[6] << 2 | tdata[5] >> 6) & 0xf;
+	touch->x = (int)((__u32)tdata[1] << 28 | (__u32)tdata[0] << 20) >> 20;
+	touch->y = -((int)((__u32)tdata[2] << 24 | (__u32)tdata[1] << 16) >> 20);
+	touch->size = tdata[5] & 0x3f;
+	touch->orientation = (tdata[6] >> 2) - 32;
+	touch->touch_major = tdata[3];
+	touch->touch_minor = tdata[4];
+	touch->state = tdata[7] & TOUCH_STATE_MASK;
+}
+
+/* data[2] (lsb) and data[3] (msb) are the signed x movement of a Magic
+ * Mouse 2 report, data[4] and data[5] the y movement.
+ */
+static inline void magicmouse2_decode_motion(const __u8 *data, int *x, int *y)
+{
+	*x = (int)((__u32)data[3] << 24 | (__u32)data[2] << 16) >> 16;
+	*y = (int)((__u32)data[5] << 24 | (__u32)data[4] << 16) >> 16;
+}
+
+/* Decoded frame ring, mapped read-only from /dev/magicmouse-<hid device>
+ * when the driver is loaded with frame_ring=1. The mapping starts with a
+ * struct magicmouse_frame_ring header, followed by @frame_count frames of
+ * @frame_size bytes at @frames_offset.
+ *
+ * The driver writes one frame per touch report into slot head %
+ * frame_count and then advances @head. A consumer keeps its own count of
+ * the frames it has read. After copying a frame it re-reads @head; if the
+ * driver has moved more than frame_count - 1 frames past it in the
+ * meantime, the copy may be torn and the frame is lost. poll() on the
+ * device reports EPOLLIN once @head moved since the last poll() that
+ * reported it, and EPOLLHUP once the device is gone.
+ */
+#define MAGICMOUSE_FRAME_MAGIC		0x4d4d4652	/* "MMFR" */
+#define MAGICMOUSE_FRAME_TOUCHES	MOUSE2_MAX_TOUCHES
+
+/**
+ * struct magicmouse_frame_touch - One contact of a frame.
+ * @id: Tracking ID of the contact, 0 to 15.
+ * @x: Horizontal position in units.
+ * @y: Vertical position in units, growing downwards.
+ * @touch_major: Major axis of the contact ellipse.
+ * @touch_minor: Minor axis of the contact ellipse.
+ * @size: Contact size, 0 to 63.
+ * @orientation: Ellipse orientation, -32 to 31.
+ * @state: One of the TOUCH_STATE_* values.
+ * @reserved: Zero.
+ */
+struct magicmouse_frame_touch {
+	__u8 id;
+	__u8 state;
+	__s16 x;
+	__s16 y;
+	__u8 touch_major;
+	__u8 touch_minor;
+	__u8 size;
+	__s8 orientation;
+	__u16 reserved;
+};
+
+/**
+ * struct magicmouse_frame - One decoded touch report.
+ * @time_ns: CLOCK_MONOTONIC time the report was decoded.
+ * @seq: Value of &magicmouse_frame_ring.head this frame was written at.
+ * @buttons: Physical buttons, bit 0 left and bit 1 right.
+ * @ntouches: Number of valid entries in @touch.
+ * @rel_x: Horizontal pointer motion of a mouse, 0 on trackpads.
+ * @rel_y: Vertical pointer motion of a mouse, 0 on trackpads.
+ * @reserved: Zero.
+ * @touch: Contacts in report order, palms included.
+ */
+struct magicmouse_frame {
+	__u64 time_ns;
+	__u32 seq;
+	__u8 buttons;
+	__u8 ntouches;
+	__s16 rel_x;
+	__s16 rel_y;
+	__u16 reserved[3];
+	struct magicmouse_frame_touch touch[MAGICMOUSE_FRAME_TOUCHES];
+};
+
+/**
+ * struct magicmouse_frame_ring - Header of the frame ring mapping.
+ * @magic: MAGICMOUSE_FRAME_MAGIC.
+ * @frame_size: Size of one frame, at least sizeof(struct magicmouse_frame).
+ * @frame_count: Number of frame slots, a power of two.
+ * @frames_offset: Offset of the first frame from the start of the mapping.
+ * @head: Number of frames written so far, wrapping at 2^32.
+ */
+struct magicmouse_frame_ring {
+	__u32 magic;
+	__u32 frame_size;
+	__u32 frame_count;
+	__u32 frames_offset;
+	__u32 head;
+};
+
+#endif
@@ -16,7 +16,11 @@
  */
 
 #include <linux/hid.h>
+#include <linux/bsearch.h>
 #include <linux/export.h>
+#include <linux/hashtable.h>
+#include <linux/jhash.h>
+#include <linux/rculist.h>
 #include <linux/slab.h>
 #include <linux/mutex.h>
 
@@ -951,6 +955,175 @@ static const struct hid_device_id hid_mouse_ignore_list[] = {
 	{ }
 };
 
+/*
+ * Hash indexes over the static device tables, so matching a new device
+ * does not scan several hundred entries. Entries are hashed on
+ * (bus, vendor, product); entries with a wildcard in any of these are kept
+ * on a separate list that is scanned as before. An index is built on first
+ * use; tools/hid-quirks-test checks it against the linear scan.
+ */
+#define HID_ID_HASH_BITS	7
+
+struct hid_id_node {
+	struct hlist_node node;
+	const struct hid_device_id *id;
+};
+
+struct hid_id_index {
+	const char *name;
+	const struct hid_device_id *table;
+	struct hid_id_node *nodes;
+	struct hlist_head wild;
+	bool built;
+	DECLARE_HASHTABLE(hash, HID_ID_HASH_BITS);
+};
+
+#define HID_ID_INDEX(_table)						\
+	static struct hid_id_node _table##_nodes[ARRAY_SIZE(_table)];	\
+	static struct hid_id_index _table##_index = {			\
+		.name = #_table,					\
+		.table = _table,					\
+		.nodes = _table##_nodes,				\
+	}
+
+HID_ID_INDEX(hid_quirks);
+HID_ID_INDEX(hid_have_special_driver);
+HID_ID_INDEX(hid_ignore_list);
+HID_ID_INDEX(hid_mouse_ignore_list);
+
+static DEFINE_MUTEX(hid_id_index_lock);
+
+static u32 hid_id_key(__u16 bus, __u32 vendor, __u32 product)
+{
+	return jhash_3words(bus, vendor, product, 0);
+}
+
+static bool hid_id_is_wild(const struct hid_device_id *id)
+{
+	return id->bus == HID_BUS_ANY || id->vendor == HID_ANY_ID ||
+	       id->product == HID_ANY_ID;
+}
+
+static const struct hid_device_id *
+hid_id_index_match(struct hid_id_index *index, const struct hid_device *hdev)
+{
+	const struct hid_device_id *found = NULL;
+	struct hid_id_node *n;
+
+	/*
+	 * Both chains are in table order, so the first match of each is the
+	 * earliest of its kind, and the earlier of the two is what the linear
+	 * scan would have returned.
+	 */
+	hash_for_each_possible(index->hash, n, node,
+			       hid_id_key(hdev->bus, hdev->vendor, hdev->product)) {
+		if (hid_match_one_id(hdev, n->id)) {
+			found = n->id;
+			break;
+		}
+	}
+
+	hlist_for_each_entry(n, &index->wild, node) {
+		if (found && n->id > found)
+			break;
+		if (hid_match_one_id(hdev, n->id)) {
+			found = n->id;
+			break;
+		}
+	}
+
+	return found;
+}
+
+static void hid_id_index_build(struct hid_id_index *index)
+{
+	const struct hid_device_id *id;
+	struct hid_id_node *n;
+	int count = 0;
+
+	for (id = index->table; id->bus; id++)
+		count++;
+
+	/* Insert back to front so each chain ends up in table order. */
+	while (count--) {
+		n = &index->nodes[count];
+		n->id = &index->table[count];
+		if (hid_id_is_wild(n->id))
+			hlist_add_head(&n->node, &index->wild);
+		else
+			hash_add(index->hash, &n->node,
+				 hid_id_key(n->id->bus, n->id->vendor,
+					    n->id->product));
+	}
+
+	smp_store_release(&index->built, true);
+}
+
+/**
+ * hid_id_lookup: match a HID device against an indexed static table
+ * @index: the index of the table to match against
+ * @hdev: the HID device to match
+ *
+ * Description:
+ *     Same result as hid_match_id() on the table, in constant time once
+ *     the index is built.
+ *
+ * Returns: the first matching entry of the table, NULL if none matches.
+ */
+static const struct hid_device_id *
+hid_id_lookup(struct hid_id_index *index, const struct hid_device *hdev)
+{
+	if (!smp_load_acquire(&index->built)) {
+		mutex_lock(&hid_id_index_lock);
+		if (!index->built)
+			hid_id_index_build(index);
+		mutex_unlock(&hid_id_index_lock);
+	}
+
+	return hid_id_index_match(index, hdev);
+}
+
+/*
+ * Product ranges ignored on any bus, sorted by vendor then first product
+ * and not overlapping, for a binary search.
+ */
+struct hid_id_range {
+	__u32 vendor;
+	__u32 first;
+	__u32 last;
+};
+
+static const struct hid_id_range hid_ignore_ranges[] = {
+	{ USB_VENDOR_ID_LOGITECH, USB_DEVICE_ID_LOGITECH_HARMONY_FIRST,
+	  USB_DEVICE_ID_LOGITECH_HARMONY_LAST },
+	/* all Code Mercenaries IOWarrior devices */
+	{ USB_VENDOR_ID_CODEMERCS, USB_DEVICE_ID_CODEMERCS_IOW_FIRST,
+	  USB_DEVICE_ID_CODEMERCS_IOW_LAST },
+	{ USB_VENDOR_ID_HANWANG, USB_DEVICE_ID_HANWANG_TABLET_FIRST,
+	  USB_DEVICE_ID_HANWANG_TABLET_LAST },
+	/* These are not HID devices.  They are handled by comedi. */
+	{ USB_VENDOR_ID_VELLEMAN, USB_DEVICE_ID_VELLEMAN_K8055_FIRST,
+	  USB_DEVICE_ID_VELLEMAN_K8055_LAST },
+	{ USB_VENDOR_ID_VELLEMAN, USB_DEVICE_ID_VELLEMAN_K8061_FIRST,
+	  USB_DEVICE_ID_VELLEMAN_K8061_LAST },
+	{ USB_VENDOR_ID_SOUNDGRAPH, USB_DEVICE_ID_SOUNDGRAPH_IMON_FIRST,
+	  USB_DEVICE_ID_SOUNDGRAPH_IMON_LAST },
+};
+
+static int hid_id_range_cmp(const void *key, const void *elt)
+{
+	const struct hid_device *hdev = key;
+	const struct hid_id_range *range = elt;
+
+	if (hdev->vendor != range->vendor)
+		return hdev->vendor < range->vendor ? -1 : 1;
+	if (hdev->product < range->first)
+		return -1;
+	if (hdev->product > range->last)
+		return 1;
+	return 0;
+}
+
 bool hid_ignore(struct hid_device *hdev)
 {
 	if (hdev->quirks & HID_QUIRK_NO_IGNORE)
@@ -958,17 +1131,13 @@ bool hid_ignore(struct hid_device *hdev)
 	if (hdev->quirks & HID_QUIRK_IGNORE)
 		return true;
 
+	if (bsearch(hdev, hid_ignore_ranges, ARRAY_SIZE(hid_ignore_ranges),
+		    sizeof(hid_ignore_ranges[0]), hid_id_range_cmp))
+		return true;
+
+	/* Devices that share an ID with others and need a closer look. */
 	switch (hdev->vendor) {
-	case USB_VENDOR_ID_CODEMERCS:
-		/* ignore all Code Mercenaries IOWarrior devices */
-		if (hdev->product >= USB_DEVICE_ID_CODEMERCS_IOW_FIRST &&
-		    hdev->product <= USB_DEVICE_ID_CODEMERCS_IOW_LAST)
-			return true;
-		break;
 	case USB_VENDOR_ID_LOGITECH:
-		if (hdev->product >= USB_DEVICE_ID_LOGITECH_HARMONY_FIRST &&
-		    hdev->product <= USB_DEVICE_ID_LOGITECH_HARMONY_LAST)
-			return true;
 		/*
 		 * The Keene FM transmitter USB device has the same USB ID as
 		 * the Logitech AudioHub Speaker, but it should ignore the hid.
@@ -980,29 +1149,11 @@ bool hid_ignore(struct hid_device *hdev)
 		    !strcmp(hdev->name, "HOLTEK  B-LINK USB Audio  "))
 			return true;
 		break;
-	case USB_VENDOR_ID_SOUNDGRAPH:
-		if (hdev->product >= USB_DEVICE_ID_SOUNDGRAPH_IMON_FIRST &&
-		    hdev->product <= USB_DEVICE_ID_SOUNDGRAPH_IMON_LAST)
-			return true;
-		break;
-	case USB_VENDOR_ID_HANWANG:
-		if (hdev->product >= USB_DEVICE_ID_HANWANG_TABLET_FIRST &&
-		    hdev->product <= USB_DEVICE_ID_HANWANG_TABLET_LAST)
-			return true;
-		break;
 	case USB_VENDOR_ID_JESS:
 		if (hdev->product == USB_DEVICE_ID_JESS_YUREX &&
 		    hdev->type == HID_TYPE_USBNONE)
 			return true;
 		break;
-	case USB_VENDOR_ID_VELLEMAN:
-		/* These are not HID devices.  They are handled by comedi. */
-		if ((hdev->product >= USB_DEVICE_ID_VELLEMAN_K8055_FIRST &&
-		     hdev->product <= USB_DEVICE_ID_VELLEMAN_K8055_LAST) ||
-		    (hdev->product >= USB_DEVICE_ID_VELLEMAN_K8061_FIRST &&
-		     hdev->product <= USB_DEVICE_ID_VELLEMAN_K8061_LAST))
-			return true;
-		break;
 	case USB_VENDOR_ID_ATMEL_V_USB:
 		/* Masterkit MA901 usb radio based on Atmel tiny85 chip and
 		 * it has the same USB ID as many Atmel V-USB devices. This
@@ -1029,20 +1180,32 @@ bool hid_ignore(struct hid_device *hdev)
 	}
 
 	if (hdev->type == HID_TYPE_USBMOUSE &&
-	    hid_match_id(hdev, hid_mouse_ignore_list))
+	    hid_id_lookup(&hid_mouse_ignore_list_index, hdev))
 		return true;
 
-	return !!hid_match_id(hdev, hid_ignore_list);
+	return !!hid_id_lookup(&hid_ignore_list_index, hdev);
 }
 EXPORT_SYMBOL_GPL(hid_ignore);
 
-/* Dynamic HID quirks list - specified at runtime */
+/*
+ * Dynamic HID quirks - specified at runtime. Hashed on (bus, vendor,
+ * product); entries with a wildcard in any of these are kept on
+ * dquirks_wild in the order they were added. Lookups run under RCU,
+ * changes are serialized by dquirks_lock and free replaced entries after
+ * a grace period.
+ */
 struct quirks_list_struct {
 	struct hid_device_id hid_bl_item;
-	struct list_head node;
+	struct hlist_node node;
+	struct rcu_head rcu;
+	unsigned long seq;
 };
 
-static LIST_HEAD(dquirks_list);
+#define DQUIRKS_HASH_BITS	6
+
+static DEFINE_HASHTABLE(dquirks_hash, DQUIRKS_HASH_BITS);
+static HLIST_HEAD(dquirks_wild);
+static unsigned long dquirks_seq;
 static DEFINE_MUTEX(dquirks_lock);
 
 /* Runtime ("dynamic") quirks manipulation functions */
@@ -1052,24 +1215,40 @@ static DEFINE_MUTEX(dquirks_lock);
  * @hdev: the HID device to match
  *
  * Description:
- *         Scans dquirks_list for a matching dynamic quirk and returns
- *         the pointer to the relevant struct hid_device_id if found.
- *         Must be called with a read lock held on dquirks_lock.
+ *         Looks up the first added dynamic quirk that matches, in
+ *         dquirks_hash and dquirks_wild, and returns the pointer to the
+ *         relevant struct hid_device_id if found.
+ *         Must be called under rcu_read_lock(); the entry is only valid
+ *         until rcu_read_unlock().
  *
  * Returns: NULL if no quirk found, struct hid_device_id * if found.
  */
 static struct hid_device_id *hid_exists_dquirk(const struct hid_device *hdev)
 {
-	struct quirks_list_struct *q;
+	struct quirks_list_struct *q, *found = NULL;
 	struct hid_device_id *bl_entry = NULL;
 
-	list_for_each_entry(q, &dquirks_list, node) {
+	/* Hashed entries have no wildcards, so at most one matches. */
+	hash_for_each_possible_rcu(dquirks_hash, q, node,
+			hid_id_key(hdev->bus, hdev->vendor, hdev->product)) {
+		if (hid_match_one_id(hdev, &q->hid_bl_item)) {
+			found = q;
+			break;
+		}
+	}
+
+	hlist_for_each_entry_rcu(q, &dquirks_wild, node) {
+		if (found && q->seq > found->seq)
+			break;
 		if (hid_match_one_id(hdev, &q->hid_bl_item)) {
-			bl_entry = &q->hid_bl_item;
+			found = q;
 			break;
 		}
 	}
 
+	if (found)
+		bl_entry = &found->hid_bl_item;
+
 	if (bl_entry != NULL)
 		dbg_hid("Found dynamic quirk 0x%lx for HID device 0x%hx:0x%hx\n",
 			bl_entry->driver_data, bl_entry->vendor,
@@ -1080,64 +1259,99 @@ static struct hid_device_id *hid_exists_dquirk(const struct hid_device *hdev)
 
 
 /**
- * hid_modify_dquirk: add/replace a HID quirk
- * @id: the HID device to match
- * @quirks: the unsigned long quirks value to add/replace
+ * hid_match_dquirk: match a quirk entry against a device id
+ * @id: the device id to match
+ * @entry: the quirk entry, which may hold wildcards
  *
  * Description:
- *         If an dynamic quirk exists in memory for this device, replace its
- *         quirks value with what was provided.  Otherwise, add the quirk
- *         to the dynamic quirks list.
- *
- * Returns: 0 OK, -error on failure.
+ *         Same rules as hid_match_one_id(), on a plain id so that no
+ *         struct hid_device is needed.
  */
-static int hid_modify_dquirk(const struct hid_device_id *id,
-			     const unsigned long quirks)
+static bool hid_match_dquirk(const struct hid_device_id *id,
+			     const struct hid_device_id *entry)
 {
-	struct hid_device *hdev;
-	struct quirks_list_struct *q_new, *q;
-	int list_edited = 0;
-	int ret = 0;
-
-	hdev = kzalloc(sizeof(*hdev), GFP_KERNEL);
-	if (!hdev)
-		return -ENOMEM;
-
-	q_new = kmalloc(sizeof(struct quirks_list_struct), GFP_KERNEL);
-	if (!q_new) {
-		ret = -ENOMEM;
-		goto out;
-	}
+	return (entry->bus == HID_BUS_ANY || entry->bus == id->bus) &&
+	       (entry->group == HID_GROUP_ANY || entry->group == id->group) &&
+	       (entry->vendor == HID_ANY_ID || entry->vendor == id->vendor) &&
+	       (entry->product == HID_ANY_ID || entry->product == id->product);
+}
 
-	hdev->bus = q_new->hid_bl_item.bus = id->bus;
-	hdev->group = q_new->hid_bl_item.group = id->group;
-	hdev->vendor = q_new->hid_bl_item.vendor = id->vendor;
-	hdev->product = q_new->hid_bl_item.product = id->product;
-	q_new->hid_bl_item.driver_data = quirks;
+/**
+ * hid_modify_dquirk: add/replace HID quirks
+ * @q_new: the new quirk entries, filled in
+ * @count: number of entries in @q_new
+ *
+ * Description:
+ *         For each entry, if a dynamic quirk exists in memory for this
+ *         device, replace the first added one with the entry, which takes
+ *         over its place in the order.  Otherwise, add the entry to the
+ *         dynamic quirks.  Entries are applied in order under one hold of
+ *         dquirks_lock, so a later entry for the same device wins.
+ *         Takes ownership of the entries.
+ */
+static void hid_modify_dquirk(struct quirks_list_struct **q_new, int count)
+{
+	struct quirks_list_struct *q, *old, *last;
+	const struct hid_device_id *id;
+	bool wild;
+	int n;
 
 	mutex_lock(&dquirks_lock);
 
-	list_for_each_entry(q, &dquirks_list, node) {
+	for (n = 0; n < count; n++) {
+		id = &q_new[n]->hid_bl_item;
+		wild = hid_id_is_wild(id);
+		old = NULL;
+		last = NULL;
 
-		if (hid_match_one_id(hdev, &q->hid_bl_item)) {
+		hash_for_each_possible(dquirks_hash, q, node,
+				       hid_id_key(id->bus, id->vendor, id->product)) {
+			if (hid_match_dquirk(id, &q->hid_bl_item)) {
+				old = q;
+				break;
+			}
+		}
 
-			list_replace(&q->node, &q_new->node);
-			kfree(q);
-			list_edited = 1;
-			break;
+		hlist_for_each_entry(q, &dquirks_wild, node) {
+			if (old && q->seq > old->seq)
+				break;
+			if (hid_match_dquirk(id, &q->hid_bl_item)) {
+				old = q;
+				break;
+			}
+		}
 
+		if (old) {
+			q_new[n]->seq = old->seq;
+			if (wild == hid_id_is_wild(&old->hid_bl_item)) {
+				hlist_replace_rcu(&old->node, &q_new[n]->node);
+			} else {
+				/* A specific entry replacing a wildcard one. */
+				hlist_del_rcu(&old->node);
+				hash_add_rcu(dquirks_hash, &q_new[n]->node,
+					     hid_id_key(id->bus, id->vendor,
+							id->product));
+			}
+			kfree_rcu(old, rcu);
+			continue;
 		}
 
-	}
+		q_new[n]->seq = ++dquirks_seq;
+		if (!wild) {
+			hash_add_rcu(dquirks_hash, &q_new[n]->node,
+				     hid_id_key(id->bus, id->vendor, id->product));
+			continue;
+		}
 
-	if (!list_edited)
-		list_add_tail(&q_new->node, &dquirks_list);
+		hlist_for_each_entry(q, &dquirks_wild, node)
+			last = q;
+		if (last)
+			hlist_add_behind_rcu(&q_new[n]->node, &last->node);
+		else
+			hlist_add_head_rcu(&q_new[n]->node, &dquirks_wild);
+	}
 
 	mutex_unlock(&dquirks_lock);
-
- out:
-	kfree(hdev);
-	return ret;
 }
 
 /**
@@ -1151,13 +1365,21 @@ static int hid_modify_dquirk(const struct hid_device_id *id,
  */
 static void hid_remove_all_dquirks(__u16 bus)
 {
-	struct quirks_list_struct *q, *temp;
+	struct quirks_list_struct *q;
+	struct hlist_node *temp;
+	int bkt;
 
 	mutex_lock(&dquirks_lock);
-	list_for_each_entry_safe(q, temp, &dquirks_list, node) {
+	hash_for_each_safe(dquirks_hash, bkt, temp, q, node) {
 		if (bus == HID_BUS_ANY || bus == q->hid_bl_item.bus) {
-			list_del(&q->node);
-			kfree(q);
+			hash_del_rcu(&q->node);
+			kfree_rcu(q, rcu);
+		}
+	}
+	hlist_for_each_entry_safe(q, temp, &dquirks_wild, node) {
+		if (bus == HID_BUS_ANY || bus == q->hid_bl_item.bus) {
+			hlist_del_rcu(&q->node);
+			kfree_rcu(q, rcu);
 		}
 	}
 	mutex_unlock(&dquirks_lock);
@@ -1169,28 +1391,37 @@ static void hid_remove_all_dquirks(__u16 bus)
  */
 int hid_quirks_init(char **quirks_param, __u16 bus, int count)
 {
-	struct hid_device_id id = { 0 };
-	int n = 0, m;
+	struct quirks_list_struct **batch, *q;
+	int n = 0, m, parsed = 0;
 	unsigned short int vendor, product;
 	u32 quirks;
 
-	id.bus = bus;
+	batch = kcalloc(count, sizeof(*batch), GFP_KERNEL);
+	if (!batch)
+		return -ENOMEM;
 
 	for (; n < count && quirks_param[n]; n++) {
 
 		m = sscanf(quirks_param[n], "0x%hx:0x%hx:0x%x",
 				&vendor, &product, &quirks);
 
-		id.vendor = (__u16)vendor;
-		id.product = (__u16)product;
-
-		if (m != 3 ||
-		    hid_modify_dquirk(&id, quirks) != 0) {
+		q = m == 3 ? kzalloc(sizeof(*q), GFP_KERNEL) : NULL;
+		if (!q) {
 			pr_warn("Could not parse HID quirk module param %s\n",
 				quirks_param[n]);
+			continue;
 		}
+
+		q->hid_bl_item.bus = bus;
+		q->hid_bl_item.vendor = (__u16)vendor;
+		q->hid_bl_item.product = (__u16)product;
+		q->hid_bl_item.driver_data = quirks;
+		batch[parsed++] = q;
 	}
 
+	hid_modify_dquirk(batch, parsed);
+	kfree(batch);
+
 	return 0;
 }
 EXPORT_SYMBOL_GPL(hid_quirks_init);
@@ -1227,13 +1458,13 @@ static unsigned long hid_gets_squirk(const struct hid_device *hdev)
 	const struct hid_device_id *bl_entry;
 	unsigned long quirks = 0;
 
-	if (hid_match_id(hdev, hid_ignore_list))
+	if (hid_id_lookup(&hid_ignore_list_index, hdev))
 		quirks |= HID_QUIRK_IGNORE;
 
-	if (hid_match_id(hdev, hid_have_special_driver))
+	if (hid_id_lookup(&hid_have_special_driver_index, hdev))
 		quirks |= HID_QUIRK_HAVE_SPECIAL_DRIVER;
 
-	bl_entry = hid_match_id(hdev, hid_quirks);
+	bl_entry = hid_id_lookup(&hid_quirks_index, hdev);
 	if (bl_entry != NULL)
 		quirks |= bl_entry->driver_data;
 
@@ -1278,13 +1509,14 @@ unsigned long hid_lookup_quirk(const struct hid_device *hdev)
 		}
 	}
 
-	mutex_lock(&dquirks_lock);
+	rcu_read_lock();
 	quirk_entry = hid_exists_dquirk(hdev);
 	if (quirk_entry)
 		quirks = quirk_entry->driver_data;
-	else
+	rcu_read_unlock();
+
+	if (!quirk_entry)
 		quirks = hid_gets_squirk(hdev);
-	mutex_unlock(&dquirks_lock);
 
 	return quirks;
 }
@@ -0,0 +1,34 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * The parts of udev-hid-bpf's hid_bpf.h the samples use, so that they
+ * also build on their own. Inside udev-hid-bpf its own header is used.
+ */
+
+#ifndef __HID_BPF_H
+#define __HID_BPF_H
+
+#include <bpf/bpf_helpers.h>
+
+#define HID_BPF_DEVICE_EVENT	"struct_ops/hid_device_event"
+
+#define HID_BPF_OPS(name)	SEC(".struct_ops.link") struct hid_bpf_ops name
+
+#define __HID_BPF_COMBINE(a, b)	a##b
+#define HID_BPF_COMBINE(a, b)	__HID_BPF_COMBINE(a, b)
+
+/* Devices a program is meant for, as BTF metadata for udev-hid-bpf. */
+#define HID_DEVICE(b, g, ven, prod)				\
+	struct {						\
+		__uint(name, 0);				\
+		__uint(bus, (b));				\
+		__uint(group, (g));				\
+		__uint(vid, (ven));				\
+		__uint(pid, (prod));				\
+	} HID_BPF_COMBINE(_device, __LINE__);
+
+#define HID_BPF_CONFIG(...)					\
+	union {							\
+		__VA_ARGS__					\
+	} _device_ids SEC(".hid_bpf_config")
+
+#endif
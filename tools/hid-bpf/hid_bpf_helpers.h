@@ -0,0 +1,15 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * HID-BPF kfuncs the samples call, as declared by udev-hid-bpf's
+ * hid_bpf_helpers.h.
+ */
+
+#ifndef __HID_BPF_HELPERS_H
+#define __HID_BPF_HELPERS_H
+
+#include <bpf/bpf_helpers.h>
+
+extern __u8 *hid_bpf_get_data(struct hid_bpf_ctx *ctx, unsigned int offset,
+			      const size_t __sz) __ksym;
+
+#endif
@@ -0,0 +1,93 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * HID-BPF sample: hide palm contacts of a Magic Mouse 2.
+ *
+ * Runs on every input report before hid-magicmouse2 (or the in-tree
+ * hid-magicmouse) decodes it. Touch records whose contact is as large as
+ * a palm are rewritten to TOUCH_STATE_NONE, so the driver sees the
+ * contact lift instead of a finger that scrolls or selects a button. A
+ * contact stays hidden until it really lifts, even if it shrinks again.
+ *
+ * Build and load it with udev-hid-bpf: copy this file together with
+ * linux/drivers/hid/hid-magicmouse2.h into its src/bpf/testing directory.
+ * make here builds it on its own with clang against the running kernel's
+ * vmlinux.h, along with the libbpf skeleton the uhid benchmark attaches
+ * it with (magicmouse-uhid-bench -p).
+ */
+
+#include "vmlinux.h"
+#include "hid_bpf.h"
+#include "hid_bpf_helpers.h"
+#include <bpf/bpf_tracing.h>
+
+#include "hid-magicmouse2.h"
+
+#ifndef BUS_BLUETOOTH
+#define BUS_BLUETOOTH		0x05
+#endif
+#ifndef HID_GROUP_ANY
+#define HID_GROUP_ANY		0x0000
+#endif
+
+#define VID_APPLE_BT		0x004c
+#define PID_MAGICMOUSE2		0x0269
+
+HID_BPF_CONFIG(
+	HID_DEVICE(BUS_BLUETOOTH, HID_GROUP_ANY, VID_APPLE_BT, PID_MAGICMOUSE2)
+);
+
+/* Same thresholds as the driver's palm_size and palm_major defaults for
+ * mice.
+ */
+#define PALM_SIZE		32
+#define PALM_MAJOR		100
+
+#define REPORT_SIZE \
+	(MOUSE2_HEADER_SIZE + MOUSE2_MAX_TOUCHES * MOUSE2_TOUCH_SIZE)
+
+/* Tracking IDs currently hidden as palms. */
+static __u16 palms;
+
+SEC(HID_BPF_DEVICE_EVENT)
+int BPF_PROG(magicmouse_mask_palms, struct hid_bpf_ctx *hctx)
+{
+	struct magicmouse_touch touch;
+	__u8 *data = hid_bpf_get_data(hctx, 0, REPORT_SIZE);
+	__u8 *tdata;
+	int npoints, ii;
+
+	if (!data || data[0] != MOUSE2_REPORT_ID)
+		return 0;
+
+	if (hctx->size < MOUSE2_HEADER_SIZE ||
+	    (hctx->size - MOUSE2_HEADER_SIZE) % MOUSE2_TOUCH_SIZE)
+		return 0;
+	npoints = (hctx->size - MOUSE2_HEADER_SIZE) / MOUSE2_TOUCH_SIZE;
+
+	for (ii = 0; ii < MOUSE2_MAX_TOUCHES; ii++) {
+		if (ii >= npoints)
+			break;
+
+		tdata = data + MOUSE2_HEADER_SIZE + ii * MOUSE2_TOUCH_SIZE;
+		magicmouse_decode_touch(tdata, &touch);
+
+		if (touch.state == TOUCH_STATE_NONE) {
+			palms &= ~(1 << touch.id);
+			continue;
+		}
+
+		if (touch.size >= PALM_SIZE || touch.touch_major >= PALM_MAJOR)
+			palms |= 1 << touch.id;
+
+		if (palms & (1 << touch.id))
+			tdata[7] &= ~TOUCH_STATE_MASK;
+	}
+
+	return 0;
+}
+
+HID_BPF_OPS(magicmouse_mask_palms) = {
+	.hid_device_event = (void *)magicmouse_mask_palms,
+};
+
+char _license[] SEC("license") = "GPL";
@@ -0,0 +1,861 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ *  Userspace build of hid-quirks.c
+ *
+ *  hid-quirks.c is built here against the stand-in headers in include/
+ *  and its static functions are called directly. The hash indexes over
+ *  the static tables are checked against hid_match_id(), the linear scan
+ *  they replace, for every table entry and for ids next to each entry.
+ *  The ignored product ranges are checked to be sorted and disjoint, as
+ *  the binary search in hid_ignore() needs. hid_ignore() and
+ *  hid_lookup_quirk() are compared with the code they replaced on a
+ *  synthetic device population, with dynamic quirks installed.
+ *
+ *  With -b it also times both against the replaced code, per kind of
+ *  device and for the mix, in nanoseconds per call. The mixed lookups are
+ *  then repeated from 1, 2, 4... up to -t threads at once, and dynamic
+ *  quirk insertion is timed for growing quirks= lists.
+ *
+ *  Usage: hid-quirks-test [-b] [-n devices] [-r rounds]
+ *                         [-q dynamic quirks] [-t threads]
+ *
+ *  Exits with status 1 if any check fails.
+ */
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hid-quirks.c"
+
+#define DEFAULT_DEVICES		4096
+#define DEFAULT_ROUNDS		100
+#define DEFAULT_DQUIRKS		64
+#define DEFAULT_THREADS		4
+
+static struct hid_id_index *indexes[] = {
+	&hid_quirks_index,
+	&hid_have_special_driver_index,
+	&hid_ignore_list_index,
+	&hid_mouse_ignore_list_index,
+};
+
+static long probes;
+
+static int check_probe(struct hid_id_index *index,
+		       const struct hid_device *hdev)
+{
+	const struct hid_device_id *want, *got;
+
+	probes++;
+	want = hid_match_id(hdev, index->table);
+	got = hid_id_lookup(index, hdev);
+	if (got == want)
+		return 0;
+
+	fprintf(stderr, "%s: %04x:%04x:%04x matched entry %td, expected %td\n",
+		index->name, hdev->bus, hdev->vendor, hdev->product,
+		got ? got - index->table : -1,
+		want ? want - index->table : -1);
+	return 1;
+}
+
+/*
+ * Probe each entry on every bus, and with the vendor or the product one
+ * off, so that wildcard entries, bus mismatches and near misses that
+ * share a hash chain are all covered.
+ */
+static int check_index(struct hid_id_index *index)
+{
+	static const __u16 buses[] = { BUS_USB, BUS_BLUETOOTH, BUS_I2C };
+	const struct hid_device_id *id;
+	struct hid_device hdev = { .group = HID_GROUP_GENERIC };
+	int errors = 0;
+	int ii;
+
+	for (id = index->table; id->bus; id++) {
+		for (ii = 0; ii < ARRAY_SIZE(buses); ii++) {
+			hdev.bus = buses[ii];
+			hdev.vendor = id->vendor == HID_ANY_ID ? 0 : id->vendor;
+			hdev.product = id->product == HID_ANY_ID ? 0 : id->product;
+			errors += check_probe(index, &hdev);
+
+			hdev.product ^= 1;
+			errors += check_probe(index, &hdev);
+
+			hdev.product ^= 1;
+			hdev.vendor ^= 1;
+			errors += check_probe(index, &hdev);
+		}
+	}
+
+	return errors;
+}
+
+/* Each range must lie after the one before it, in the order bsearch uses. */
+static int check_ranges(void)
+{
+	const struct hid_id_range *r = hid_ignore_ranges, *prev;
+	int errors = 0;
+	int ii;
+
+	for (ii = 0; ii < ARRAY_SIZE(hid_ignore_ranges); ii++) {
+		if (r[ii].first > r[ii].last) {
+			fprintf(stderr, "range %d: %04x:%04x-%04x is empty\n",
+				ii, r[ii].vendor, r[ii].first, r[ii].last);
+			errors++;
+		}
+		if (!ii)
+			continue;
+
+		prev = &r[ii - 1];
+		if (prev->vendor > r[ii].vendor ||
+		    (prev->vendor == r[ii].vendor && prev->last >= r[ii].first)) {
+			fprintf(stderr, "range %d: %04x:%04x-%04x is not after %04x:%04x-%04x\n",
+				ii, r[ii].vendor, r[ii].first, r[ii].last,
+				prev->vendor, prev->first, prev->last);
+			errors++;
+		}
+	}
+
+	printf("ranges: %zu ranges, %d errors\n",
+	       ARRAY_SIZE(hid_ignore_ranges), errors);
+	return errors;
+}
+
+/* hid_ignore() as it was before the indexes and the range table. */
+static bool old_hid_ignore(struct hid_device *hdev)
+{
+	if (hdev->quirks & HID_QUIRK_NO_IGNORE)
+		return false;
+	if (hdev->quirks & HID_QUIRK_IGNORE)
+		return true;
+
+	switch (hdev->vendor) {
+	case USB_VENDOR_ID_CODEMERCS:
+		if (hdev->product >= USB_DEVICE_ID_CODEMERCS_IOW_FIRST &&
+		    hdev->product <= USB_DEVICE_ID_CODEMERCS_IOW_LAST)
+			return true;
+		break;
+	case USB_VENDOR_ID_LOGITECH:
+		if (hdev->product >= USB_DEVICE_ID_LOGITECH_HARMONY_FIRST &&
+		    hdev->product <= USB_DEVICE_ID_LOGITECH_HARMONY_LAST)
+			return true;
+		if (hdev->product == USB_DEVICE_ID_LOGITECH_AUDIOHUB &&
+		    !strcmp(hdev->name, "HOLTEK  B-LINK USB Audio  "))
+			return true;
+		break;
+	case USB_VENDOR_ID_SOUNDGRAPH:
+		if (hdev->product >= USB_DEVICE_ID_SOUNDGRAPH_IMON_FIRST &&
+		    hdev->product <= USB_DEVICE_ID_SOUNDGRAPH_IMON_LAST)
+			return true;
+		break;
+	case USB_VENDOR_ID_HANWANG:
+		if (hdev->product >= USB_DEVICE_ID_HANWANG_TABLET_FIRST &&
+		    hdev->product <= USB_DEVICE_ID_HANWANG_TABLET_LAST)
+			return true;
+		break;
+	case USB_VENDOR_ID_JESS:
+		if (hdev->product == USB_DEVICE_ID_JESS_YUREX &&
+		    hdev->type == HID_TYPE_USBNONE)
+			return true;
+		break;
+	case USB_VENDOR_ID_VELLEMAN:
+		if ((hdev->product >= USB_DEVICE_ID_VELLEMAN_K8055_FIRST &&
+		     hdev->product <= USB_DEVICE_ID_VELLEMAN_K8055_LAST) ||
+		    (hdev->product >= USB_DEVICE_ID_VELLEMAN_K8061_FIRST &&
+		     hdev->product <= USB_DEVICE_ID_VELLEMAN_K8061_LAST))
+			return true;
+		break;
+	case USB_VENDOR_ID_ATMEL_V_USB:
+		if (hdev->product == USB_DEVICE_ID_ATMEL_V_USB &&
+		    hdev->bus == BUS_USB &&
+		    strncmp(hdev->name, "www.masterkit.ru MA901", 22) == 0)
+			return true;
+		break;
+	case USB_VENDOR_ID_ELAN:
+		if (hdev->product == 0x0401 &&
+		    strncmp(hdev->name, "ELAN0800", 8) != 0)
+			return true;
+		break;
+	}
+
+	if (hdev->type == HID_TYPE_USBMOUSE &&
+	    hid_match_id(hdev, hid_mouse_ignore_list))
+		return true;
+
+	return !!hid_match_id(hdev, hid_ignore_list);
+}
+
+/* Dynamic quirks as they were: a list walked under dquirks_lock. */
+struct old_quirk {
+	struct hid_device_id id;
+	struct old_quirk *next;
+};
+
+static struct old_quirk *old_dquirks;
+static DEFINE_MUTEX(old_dquirks_lock);
+
+static int old_modify_dquirk(const struct hid_device_id *id,
+			     unsigned long quirks)
+{
+	struct old_quirk *q_new, **q;
+	struct hid_device *hdev;
+
+	hdev = kzalloc(sizeof(*hdev), GFP_KERNEL);
+	if (!hdev)
+		return -ENOMEM;
+
+	q_new = malloc(sizeof(*q_new));
+	if (!q_new) {
+		kfree(hdev);
+		return -ENOMEM;
+	}
+
+	hdev->bus = q_new->id.bus = id->bus;
+	hdev->group = q_new->id.group = id->group;
+	hdev->vendor = q_new->id.vendor = id->vendor;
+	hdev->product = q_new->id.product = id->product;
+	q_new->id.driver_data = quirks;
+	q_new->next = NULL;
+
+	mutex_lock(&old_dquirks_lock);
+	for (q = &old_dquirks; *q; q = &(*q)->next) {
+		if (hid_match_one_id(hdev, &(*q)->id)) {
+			q_new->next = (*q)->next;
+			free(*q);
+			break;
+		}
+	}
+	*q = q_new;
+	mutex_unlock(&old_dquirks_lock);
+
+	kfree(hdev);
+	return 0;
+}
+
+static void old_quirks_init(char **quirks_param, __u16 bus, int count)
+{
+	struct hid_device_id id = { .bus = bus };
+	unsigned short int vendor, product;
+	u32 quirks;
+	int n, m;
+
+	for (n = 0; n < count && quirks_param[n]; n++) {
+		m = sscanf(quirks_param[n], "0x%hx:0x%hx:0x%x",
+			   &vendor, &product, &quirks);
+		id.vendor = vendor;
+		id.product = product;
+		if (m != 3 || old_modify_dquirk(&id, quirks))
+			pr_warn("Could not parse HID quirk module param %s\n",
+				quirks_param[n]);
+	}
+}
+
+static void old_quirks_exit(void)
+{
+	struct old_quirk *q;
+
+	mutex_lock(&old_dquirks_lock);
+	while ((q = old_dquirks)) {
+		old_dquirks = q->next;
+		free(q);
+	}
+	mutex_unlock(&old_dquirks_lock);
+}
+
+/* hid_lookup_quirk() as it was: linear scans, all under one mutex. */
+static unsigned long old_hid_lookup_quirk(const struct hid_device *hdev)
+{
+	const struct hid_device_id *bl_entry;
+	unsigned long quirks = 0;
+	struct old_quirk *q;
+
+	if (hdev->bus == BUS_USB &&
+	    hdev->vendor == USB_VENDOR_ID_NCR &&
+	    hdev->product >= USB_DEVICE_ID_NCR_FIRST &&
+	    hdev->product <= USB_DEVICE_ID_NCR_LAST)
+		return HID_QUIRK_NO_INIT_REPORTS;
+
+	if (hdev->bus == BUS_USB && hdev->vendor == USB_VENDOR_ID_JABRA) {
+		switch (hdev->product) {
+		case USB_DEVICE_ID_JABRA_SPEAK_410:
+			if (hdev->version < 0x0111)
+				return HID_QUIRK_IGNORE;
+			break;
+		case USB_DEVICE_ID_JABRA_SPEAK_510:
+			if (hdev->version < 0x0214)
+				return HID_QUIRK_IGNORE;
+			break;
+		}
+	}
+
+	mutex_lock(&old_dquirks_lock);
+	for (q = old_dquirks; q; q = q->next)
+		if (hid_match_one_id(hdev, &q->id))
+			break;
+
+	if (q) {
+		quirks = q->id.driver_data;
+	} else {
+		if (hid_match_id(hdev, hid_ignore_list))
+			quirks |= HID_QUIRK_IGNORE;
+		if (hid_match_id(hdev, hid_have_special_driver))
+			quirks |= HID_QUIRK_HAVE_SPECIAL_DRIVER;
+		bl_entry = hid_match_id(hdev, hid_quirks);
+		if (bl_entry)
+			quirks |= bl_entry->driver_data;
+	}
+	mutex_unlock(&old_dquirks_lock);
+
+	return quirks;
+}
+
+/*
+ * Synthetic devices: ids taken from a table, ids only a wildcard entry
+ * matches, products inside an ignored range, the devices matched by name
+ * or version, ids with a dynamic quirk, and random ids that are almost
+ * never listed.
+ */
+enum {
+	POP_HIT,
+	POP_WILD,
+	POP_RANGE,
+	POP_NAMED,
+	POP_DQUIRK,
+	POP_MISS,
+	POP_KINDS,
+};
+
+static const char * const pop_names[] = {
+	"hit", "wildcard", "range", "named", "dquirk", "miss",
+};
+
+static unsigned int pop_seed = 1;
+
+static unsigned int pop_random(void)
+{
+	pop_seed ^= pop_seed << 13;
+	pop_seed ^= pop_seed >> 17;
+	pop_seed ^= pop_seed << 5;
+	return pop_seed;
+}
+
+static int table_size(const struct hid_device_id *table)
+{
+	int count = 0;
+
+	while (table[count].bus)
+		count++;
+	return count;
+}
+
+/* The dynamic quirks installed for the checks and the benchmark. */
+static char **dquirk_params;
+static int dquirk_count;
+
+static char **make_dquirk_params(int count)
+{
+	char **params;
+	int ii;
+
+	params = calloc(count, sizeof(*params));
+	if (!params)
+		return NULL;
+
+	for (ii = 0; ii < count; ii++) {
+		if (asprintf(&params[ii], "0x%04x:0x%04x:0x%lx",
+			     pop_random() & 0xffff, pop_random() & 0xffff,
+			     HID_QUIRK_NOGET) < 0) {
+			while (ii--)
+				free(params[ii]);
+			free(params);
+			return NULL;
+		}
+	}
+
+	return params;
+}
+
+static void free_dquirk_params(char **params, int count)
+{
+	while (count--)
+		free(params[count]);
+	free(params);
+}
+
+static void pop_make(struct hid_device *hdev, int kind)
+{
+	static const struct hid_device named[] = {
+		{ .vendor = USB_VENDOR_ID_LOGITECH,
+		  .product = USB_DEVICE_ID_LOGITECH_AUDIOHUB,
+		  .name = "HOLTEK  B-LINK USB Audio  " },
+		{ .vendor = USB_VENDOR_ID_LOGITECH,
+		  .product = USB_DEVICE_ID_LOGITECH_AUDIOHUB,
+		  .name = "HOLTEK  AudioHub Speaker" },
+		{ .vendor = USB_VENDOR_ID_ATMEL_V_USB,
+		  .product = USB_DEVICE_ID_ATMEL_V_USB,
+		  .name = "www.masterkit.ru MA901" },
+		{ .vendor = USB_VENDOR_ID_ELAN, .product = 0x0401,
+		  .name = "ELAN0800" },
+		{ .vendor = USB_VENDOR_ID_ELAN, .product = 0x0401,
+		  .name = "ELAN0401" },
+		{ .vendor = USB_VENDOR_ID_JESS,
+		  .product = USB_DEVICE_ID_JESS_YUREX,
+		  .type = HID_TYPE_USBNONE },
+		{ .vendor = USB_VENDOR_ID_NCR,
+		  .product = USB_DEVICE_ID_NCR_FIRST },
+		{ .vendor = USB_VENDOR_ID_JABRA,
+		  .product = USB_DEVICE_ID_JABRA_SPEAK_410,
+		  .version = 0x0110 },
+		{ .vendor = USB_VENDOR_ID_JABRA,
+		  .product = USB_DEVICE_ID_JABRA_SPEAK_510,
+		  .version = 0x0214 },
+	};
+	struct hid_id_index *index;
+	const struct hid_device_id *id;
+	const struct hid_id_range *range;
+	unsigned short int vendor, product;
+
+	memset(hdev, 0, sizeof(*hdev));
+	hdev->bus = BUS_USB;
+	hdev->group = HID_GROUP_GENERIC;
+
+	switch (kind) {
+	case POP_HIT:
+		index = indexes[pop_random() % ARRAY_SIZE(indexes)];
+		id = &index->table[pop_random() % table_size(index->table)];
+		if (id->bus != HID_BUS_ANY)
+			hdev->bus = id->bus;
+		hdev->vendor = id->vendor;
+		hdev->product = id->product;
+		if (index == &hid_mouse_ignore_list_index)
+			hdev->type = HID_TYPE_USBMOUSE;
+		break;
+	case POP_WILD:
+		hdev->bus = pop_random() & 1 ? BUS_BLUETOOTH : BUS_I2C;
+		hdev->vendor = USB_VENDOR_ID_ALPS_JP;
+		hdev->product = HID_DEVICE_ID_ALPS_U1_DUAL;
+		break;
+	case POP_RANGE:
+		range = &hid_ignore_ranges[pop_random() %
+					   ARRAY_SIZE(hid_ignore_ranges)];
+		hdev->vendor = range->vendor;
+		hdev->product = range->first +
+				pop_random() % (range->last - range->first + 1);
+		break;
+	case POP_NAMED:
+		*hdev = named[pop_random() % ARRAY_SIZE(named)];
+		hdev->bus = BUS_USB;
+		hdev->group = HID_GROUP_GENERIC;
+		break;
+	case POP_DQUIRK:
+		if (dquirk_count &&
+		    sscanf(dquirk_params[pop_random() % dquirk_count],
+			   "0x%hx:0x%hx", &vendor, &product) == 2) {
+			hdev->vendor = vendor;
+			hdev->product = product;
+			break;
+		}
+		/* fall through */
+	default:
+		hdev->vendor = pop_random() & 0xffff;
+		hdev->product = pop_random() & 0xffff;
+		break;
+	}
+}
+
+/*
+ * Compare with the replaced code on every kind of device, and on both
+ * sides of every range boundary.
+ */
+static int check_ignore(struct hid_device *devs, int count)
+{
+	const struct hid_id_range *range;
+	struct hid_device hdev = { .bus = BUS_USB };
+	int errors = 0;
+	int ii, jj;
+
+	for (ii = 0; ii < count; ii++) {
+		if (hid_ignore(&devs[ii]) == old_hid_ignore(&devs[ii]))
+			continue;
+		fprintf(stderr, "ignore: %04x:%04x:%04x \"%s\" differs\n",
+			devs[ii].bus, devs[ii].vendor, devs[ii].product,
+			devs[ii].name);
+		errors++;
+	}
+
+	for (ii = 0; ii < ARRAY_SIZE(hid_ignore_ranges); ii++) {
+		range = &hid_ignore_ranges[ii];
+		for (jj = -1; jj <= 1; jj++) {
+			hdev.vendor = range->vendor + jj;
+			hdev.product = range->first - 1;
+			errors += hid_ignore(&hdev) != old_hid_ignore(&hdev);
+			hdev.product = range->first;
+			errors += hid_ignore(&hdev) != old_hid_ignore(&hdev);
+			hdev.product = range->last;
+			errors += hid_ignore(&hdev) != old_hid_ignore(&hdev);
+			hdev.product = range->last + 1;
+			errors += hid_ignore(&hdev) != old_hid_ignore(&hdev);
+		}
+	}
+
+	printf("ignore: %d devices, %d mismatches\n", count, errors);
+	return errors;
+}
+
+static int check_lookup(struct hid_device *devs, int count)
+{
+	unsigned long want, got;
+	int errors = 0;
+	int ii;
+
+	for (ii = 0; ii < count; ii++) {
+		want = old_hid_lookup_quirk(&devs[ii]);
+		got = hid_lookup_quirk(&devs[ii]);
+		if (got == want)
+			continue;
+		fprintf(stderr, "lookup: %04x:%04x:%04x gave 0x%lx, expected 0x%lx\n",
+			devs[ii].bus, devs[ii].vendor, devs[ii].product,
+			got, want);
+		errors++;
+	}
+
+	printf("lookup: %d devices, %d dynamic quirks, %d mismatches\n",
+	       count, dquirk_count, errors);
+	return errors;
+}
+
+/*
+ * Dynamic quirks for any bus: some for ids that already have a USB quirk,
+ * the others new, and the last one then replaced by a USB entry. Each is
+ * looked up on USB and on Bluetooth.
+ */
+#define WILD_DQUIRKS	8
+
+static int check_wild_dquirks(void)
+{
+	char params[WILD_DQUIRKS + 1][32], *wild[WILD_DQUIRKS], *usb[1];
+	static const __u16 buses[] = { BUS_USB, BUS_BLUETOOTH };
+	unsigned short int vendor, product;
+	struct hid_device hdev = { .group = HID_GROUP_GENERIC };
+	unsigned long want, got;
+	int errors = 0;
+	int ii, jj;
+
+	for (ii = 0; ii < WILD_DQUIRKS; ii++) {
+		if (ii >= WILD_DQUIRKS / 2 || ii >= dquirk_count ||
+		    sscanf(dquirk_params[ii], "0x%hx:0x%hx",
+			   &vendor, &product) != 2) {
+			vendor = pop_random() & 0xffff;
+			product = pop_random() & 0xffff;
+		}
+		snprintf(params[ii], sizeof(params[ii]), "0x%04x:0x%04x:0x%lx",
+			 vendor, product, HID_QUIRK_ALWAYS_POLL);
+		wild[ii] = params[ii];
+	}
+	snprintf(params[ii], sizeof(params[ii]), "0x%04x:0x%04x:0x%lx",
+		 vendor, product, HID_QUIRK_NOGET | HID_QUIRK_ALWAYS_POLL);
+	usb[0] = params[ii];
+
+	old_quirks_init(wild, HID_BUS_ANY, WILD_DQUIRKS);
+	hid_quirks_init(wild, HID_BUS_ANY, WILD_DQUIRKS);
+	old_quirks_init(usb, BUS_USB, 1);
+	hid_quirks_init(usb, BUS_USB, 1);
+
+	for (ii = 0; ii < WILD_DQUIRKS; ii++) {
+		sscanf(wild[ii], "0x%hx:0x%hx", &vendor, &product);
+		hdev.vendor = vendor;
+		hdev.product = product;
+		for (jj = 0; jj < ARRAY_SIZE(buses); jj++) {
+			hdev.bus = buses[jj];
+			want = old_hid_lookup_quirk(&hdev);
+			got = hid_lookup_quirk(&hdev);
+			if (got == want)
+				continue;
+			fprintf(stderr, "wildcard dquirk: %04x:%04x:%04x gave 0x%lx, expected 0x%lx\n",
+				hdev.bus, hdev.vendor, hdev.product, got, want);
+			errors++;
+		}
+	}
+
+	printf("wildcard dquirks: %d devices, %d mismatches\n",
+	       WILD_DQUIRKS * (int)ARRAY_SIZE(buses), errors);
+
+	/* Back to only the USB quirks for the benchmark. */
+	old_quirks_exit();
+	hid_quirks_exit(HID_BUS_ANY);
+	old_quirks_init(dquirk_params, BUS_USB, dquirk_count);
+	hid_quirks_init(dquirk_params, BUS_USB, dquirk_count);
+
+	return errors;
+}
+
+typedef unsigned long (*bench_fn)(struct hid_device *hdev);
+
+static volatile unsigned long bench_sink;
+
+static double elapsed_ns(const struct timespec *start,
+			 const struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) * 1e9 +
+	       (end->tv_nsec - start->tv_nsec);
+}
+
+static void bench_run(bench_fn fn, struct hid_device *devs, int count,
+		      int rounds)
+{
+	unsigned long sink = 0;
+	int ii, round;
+
+	for (round = 0; round < rounds; round++)
+		for (ii = 0; ii < count; ii++)
+			sink += fn(&devs[ii]);
+
+	bench_sink += sink;
+}
+
+static double bench_ns(bench_fn fn, struct hid_device *devs, int count,
+		       int rounds)
+{
+	struct timespec start, end;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	bench_run(fn, devs, count, rounds);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	return elapsed_ns(&start, &end) / ((double)rounds * count);
+}
+
+static unsigned long bench_lookup(struct hid_device *hdev)
+{
+	return hid_lookup_quirk(hdev);
+}
+
+static unsigned long bench_old_lookup(struct hid_device *hdev)
+{
+	return old_hid_lookup_quirk(hdev);
+}
+
+static unsigned long bench_ignore(struct hid_device *hdev)
+{
+	return hid_ignore(hdev);
+}
+
+static unsigned long bench_old_ignore(struct hid_device *hdev)
+{
+	return old_hid_ignore(hdev);
+}
+
+/* One line per kind of device, then the mix of all kinds. */
+static void bench_kinds(const char *what, bench_fn old_fn, bench_fn new_fn,
+			struct hid_device *devs, int count, int rounds)
+{
+	int kind, ii;
+
+	printf("\n%-10s %12s %12s\n", what, "old ns", "new ns");
+	for (kind = 0; kind <= POP_KINDS; kind++) {
+		for (ii = 0; ii < count; ii++)
+			pop_make(&devs[ii], kind < POP_KINDS ?
+				 kind : pop_random() % POP_KINDS);
+		printf("%-10s %12.1f %12.1f\n",
+		       kind < POP_KINDS ? pop_names[kind] : "mixed",
+		       bench_ns(old_fn, devs, count, rounds),
+		       bench_ns(new_fn, devs, count, rounds));
+	}
+}
+
+struct bench_thread {
+	pthread_t thread;
+	pthread_barrier_t *barrier;
+	bench_fn fn;
+	struct hid_device *devs;
+	int count;
+	int rounds;
+};
+
+static void *bench_thread(void *arg)
+{
+	struct bench_thread *t = arg;
+
+	pthread_barrier_wait(t->barrier);
+	bench_run(t->fn, t->devs, t->count, t->rounds);
+	return NULL;
+}
+
+/*
+ * Every thread looks up the whole mixed population; the result is the
+ * wall time per lookup over all threads, so it drops as lookups scale.
+ */
+static double bench_threads(bench_fn fn, struct hid_device *devs, int count,
+			    int rounds, int threads)
+{
+	struct bench_thread t[threads];
+	pthread_barrier_t barrier;
+	struct timespec start, end;
+	int ii;
+
+	pthread_barrier_init(&barrier, NULL, threads + 1);
+	for (ii = 0; ii < threads; ii++) {
+		t[ii] = (struct bench_thread) {
+			.barrier = &barrier,
+			.fn = fn,
+			.devs = devs,
+			.count = count,
+			.rounds = rounds,
+		};
+		if (pthread_create(&t[ii].thread, NULL, bench_thread, &t[ii])) {
+			perror("pthread_create");
+			exit(1);
+		}
+	}
+
+	pthread_barrier_wait(&barrier);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (ii = 0; ii < threads; ii++)
+		pthread_join(t[ii].thread, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	pthread_barrier_destroy(&barrier);
+
+	return elapsed_ns(&start, &end) / ((double)rounds * count * threads);
+}
+
+/* ns per parsed entry of one hid_quirks_init() call of @count entries. */
+static double bench_insert(bool old, char **params, int count)
+{
+	struct timespec start, end;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (old)
+		old_quirks_init(params, BUS_USB, count);
+	else
+		hid_quirks_init(params, BUS_USB, count);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	if (old)
+		old_quirks_exit();
+	else
+		hid_quirks_exit(BUS_USB);
+
+	return elapsed_ns(&start, &end) / count;
+}
+
+static void bench(int count, int rounds, int max_threads)
+{
+	struct hid_device *devs;
+	char **params;
+	int ii;
+
+	devs = calloc(count, sizeof(*devs));
+	if (!devs) {
+		perror("calloc");
+		exit(1);
+	}
+
+	bench_kinds("lookup", bench_old_lookup, bench_lookup,
+		    devs, count, rounds);
+	bench_kinds("ignore", bench_old_ignore, bench_ignore,
+		    devs, count, rounds);
+
+	printf("\n%-10s %12s %12s\n", "threads", "old ns", "new ns");
+	for (ii = 0; ii < count; ii++)
+		pop_make(&devs[ii], pop_random() % POP_KINDS);
+	for (ii = 1; ii <= max_threads; ii *= 2)
+		printf("%-10d %12.1f %12.1f\n", ii,
+		       bench_threads(bench_old_lookup, devs, count, rounds, ii),
+		       bench_threads(bench_lookup, devs, count, rounds, ii));
+
+	free(devs);
+
+	/* Insertion starts from no dynamic quirks at all. */
+	old_quirks_exit();
+	hid_quirks_exit(HID_BUS_ANY);
+
+	printf("\n%-10s %12s %12s\n", "inserts", "old ns", "new ns");
+	for (ii = 64; ii <= count; ii *= 4) {
+		params = make_dquirk_params(ii);
+		if (!params) {
+			perror("make_dquirk_params");
+			exit(1);
+		}
+		printf("%-10d %12.1f %12.1f\n", ii,
+		       bench_insert(true, params, ii),
+		       bench_insert(false, params, ii));
+		free_dquirk_params(params, ii);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	struct hid_device *devs;
+	int count = DEFAULT_DEVICES, rounds = DEFAULT_ROUNDS;
+	int max_threads = DEFAULT_THREADS;
+	int errors = 0, benchmark = 0;
+	int opt, ii;
+
+	dquirk_count = DEFAULT_DQUIRKS;
+
+	while ((opt = getopt(argc, argv, "bn:r:q:t:")) != -1) {
+		switch (opt) {
+		case 'b':
+			benchmark = 1;
+			break;
+		case 'n':
+			count = atoi(optarg);
+			break;
+		case 'r':
+			rounds = atoi(optarg);
+			break;
+		case 'q':
+			dquirk_count = atoi(optarg);
+			break;
+		case 't':
+			max_threads = atoi(optarg);
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind != argc || count < 1 || rounds < 1 || dquirk_count < 0 ||
+	    max_threads < 1)
+		goto usage;
+
+	for (ii = 0; ii < ARRAY_SIZE(indexes); ii++)
+		errors += check_index(indexes[ii]);
+
+	printf("index: %ld probes, %d mismatches\n", probes, errors);
+
+	errors += check_ranges();
+
+	dquirk_params = make_dquirk_params(dquirk_count);
+	devs = calloc(count, sizeof(*devs));
+	if ((dquirk_count && !dquirk_params) || !devs) {
+		perror("calloc");
+		return 1;
+	}
+	old_quirks_init(dquirk_params, BUS_USB, dquirk_count);
+	hid_quirks_init(dquirk_params, BUS_USB, dquirk_count);
+
+	for (ii = 0; ii < count; ii++)
+		pop_make(&devs[ii], ii % POP_KINDS);
+	errors += check_ignore(devs, count);
+	errors += check_lookup(devs, count);
+	errors += check_wild_dquirks();
+	free(devs);
+
+	if (!errors && benchmark)
+		bench(count, rounds, max_threads);
+
+	old_quirks_exit();
+	hid_quirks_exit(HID_BUS_ANY);
+	free_dquirk_params(dquirk_params, dquirk_count);
+
+	return errors ? 1 : 0;
+
+usage:
+	fprintf(stderr, "usage: %s [-b] [-n devices] [-r rounds] [-q dynamic quirks] [-t threads]\n",
+		argv[0]);
+	return 1;
+}
@@ -0,0 +1,7 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+#ifndef _HQT_BSEARCH_H
+#define _HQT_BSEARCH_H
+
+#include <stdlib.h>
+
+#endif
@@ -0,0 +1,7 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+#ifndef _HQT_EXPORT_H
+#define _HQT_EXPORT_H
+
+#define EXPORT_SYMBOL_GPL(sym)	extern typeof(sym) sym
+
+#endif
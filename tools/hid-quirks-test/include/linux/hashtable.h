@@ -0,0 +1,44 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+#ifndef _HQT_HASHTABLE_H
+#define _HQT_HASHTABLE_H
+
+#include <linux/list.h>
+#include <linux/rculist.h>
+
+#define DEFINE_HASHTABLE(name, bits)					\
+	struct hlist_head name[1 << (bits)] =				\
+		{ [0 ... ((1 << (bits)) - 1)] = HLIST_HEAD_INIT }
+
+#define DECLARE_HASHTABLE(name, bits)	struct hlist_head name[1 << (bits)]
+
+#define HASH_SIZE(name)		(ARRAY_SIZE(name))
+#define HASH_BITS(name)		(__builtin_ctz(HASH_SIZE(name)))
+
+static inline u32 hash_32(u32 val, unsigned int bits)
+{
+	return (val * 0x61C88647u) >> (32 - bits);
+}
+
+#define hash_min(val, bits)	hash_32((val), (bits))
+
+#define hash_add(hashtable, node, key)					\
+	hlist_add_head(node, &hashtable[hash_min(key, HASH_BITS(hashtable))])
+
+#define hash_add_rcu(hashtable, node, key)				\
+	hlist_add_head_rcu(node, &hashtable[hash_min(key, HASH_BITS(hashtable))])
+
+#define hash_del_rcu(node)	hlist_del_rcu(node)
+
+#define hash_for_each_possible(name, obj, member, key)			\
+	hlist_for_each_entry(obj, &name[hash_min(key, HASH_BITS(name))], member)
+
+#define hash_for_each_possible_rcu(name, obj, member, key)		\
+	hlist_for_each_entry_rcu(obj, &name[hash_min(key, HASH_BITS(name))], \
+				 member)
+
+#define hash_for_each_safe(name, bkt, tmp, obj, member)			\
+	for ((bkt) = 0, obj = NULL; obj == NULL && (bkt) < HASH_SIZE(name); \
+	     (bkt)++)							\
+		hlist_for_each_entry_safe(obj, tmp, &name[bkt], member)
+
+#endif
@@ -0,0 +1,56 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+#ifndef _HQT_LIST_H
+#define _HQT_LIST_H
+
+#include <linux/kernel.h>
+
+struct hlist_node {
+	struct hlist_node *next, **pprev;
+};
+
+struct hlist_head {
+	struct hlist_node *first;
+};
+
+#define HLIST_HEAD_INIT		{ .first = NULL }
+#define HLIST_HEAD(name)	struct hlist_head name = HLIST_HEAD_INIT
+
+static inline void hlist_add_head(struct hlist_node *n, struct hlist_head *h)
+{
+	struct hlist_node *first = h->first;
+
+	n->next = first;
+	if (first)
+		first->pprev = &n->next;
+	n->pprev = &h->first;
+	smp_store_release(&h->first, n);
+}
+
+static inline void hlist_del(struct hlist_node *n)
+{
+	struct hlist_node *next = n->next;
+
+	WRITE_ONCE(*n->pprev, next);
+	if (next)
+		next->pprev = n->pprev;
+}
+
+#define hlist_entry(ptr, type, member)	container_of(ptr, type, member)
+
+#define hlist_entry_safe(ptr, type, member)				\
+	({ typeof(ptr) ____ptr = (ptr);					\
+	   ____ptr ? hlist_entry(____ptr, type, member) : NULL; })
+
+#define hlist_for_each_entry(pos, head, member)				\
+	for (pos = hlist_entry_safe(smp_load_acquire(&(head)->first),	\
+				    typeof(*(pos)), member);		\
+	     pos;							\
+	     pos = hlist_entry_safe(smp_load_acquire(&(pos)->member.next), \
+				    typeof(*(pos)), member))
+
+#define hlist_for_each_entry_safe(pos, n, head, member)			\
+	for (pos = hlist_entry_safe((head)->first, typeof(*pos), member); \
+	     pos && ({ n = pos->member.next; 1; });			\
+	     pos = hlist_entry_safe(n, typeof(*pos), member))
+
+#endif
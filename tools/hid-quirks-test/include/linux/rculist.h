@@ -0,0 +1,49 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Readers never overlap a writer in hid-quirks-test, so there is no grace
+ * period to wait for; the list updates are still published with release
+ * stores and walked with acquire loads.
+ */
+#ifndef _HQT_RCULIST_H
+#define _HQT_RCULIST_H
+
+#include <stdlib.h>
+#include <linux/list.h>
+
+struct rcu_head {
+	void *unused;
+};
+
+#define rcu_read_lock()		do { } while (0)
+#define rcu_read_unlock()	do { } while (0)
+#define kfree_rcu(ptr, field)	free(ptr)
+
+#define hlist_add_head_rcu(n, h)	hlist_add_head((n), (h))
+#define hlist_del_rcu(n)		hlist_del(n)
+
+static inline void hlist_add_behind_rcu(struct hlist_node *n,
+					struct hlist_node *prev)
+{
+	n->next = prev->next;
+	n->pprev = &prev->next;
+	smp_store_release(&prev->next, n);
+	if (n->next)
+		n->next->pprev = &n->next;
+}
+
+static inline void hlist_replace_rcu(struct hlist_node *old,
+				     struct hlist_node *new)
+{
+	struct hlist_node *next = old->next;
+
+	new->next = next;
+	new->pprev = old->pprev;
+	smp_store_release(new->pprev, new);
+	if (next)
+		next->pprev = &new->next;
+}
+
+#define hlist_for_each_entry_rcu(pos, head, member)			\
+	hlist_for_each_entry(pos, head, member)
+
+#endif
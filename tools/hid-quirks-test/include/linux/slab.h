@@ -0,0 +1,14 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+#ifndef _HQT_SLAB_H
+#define _HQT_SLAB_H
+
+#include <stdlib.h>
+#include <linux/kernel.h>
+
+#define GFP_KERNEL	0
+
+#define kzalloc(size, flags)		calloc(1, (size))
+#define kcalloc(n, size, flags)		calloc((n), (size))
+#define kfree(ptr)			free(ptr)
+
+#endif
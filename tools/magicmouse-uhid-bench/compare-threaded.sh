@@ -0,0 +1,38 @@
+#!/bin/bash
+#
+# Run magicmouse-uhid-bench with the module loaded with threaded=0 and then
+# threaded=1. The parameter is only read when the module is loaded, so the
+# module is reloaded for each run. Extra arguments go to the benchmark.
+#
+# Usage: sudo ./compare-threaded.sh [path/to/hid-magicmouse2.ko] [bench args]
+
+if [ "$EUID" -ne 0 ]
+  then echo "Please run as root"
+  exit 1
+fi
+
+set -e
+
+DIR="$( cd "$( dirname "${BASH_SOURCE[0]}" )" && pwd )"
+MODULE="${DIR}/../../linux/drivers/hid/hid-magicmouse2.ko"
+
+if [ -n "$1" ] && [ "${1%.ko}" != "$1" ]; then
+	MODULE="$1"
+	shift
+fi
+
+make -C "${DIR}" -s
+
+# The in-tree driver would claim the emulated devices as well.
+rmmod hid_magicmouse 2>/dev/null || true
+
+for threaded in 0 1; do
+	rmmod hid_magicmouse2 2>/dev/null || true
+	insmod "${MODULE}" threaded=${threaded}
+	echo "threaded=${threaded}"
+	"${DIR}/magicmouse-uhid-bench" "$@"
+done
+
+# Go back to the installed module, if there is one.
+rmmod hid_magicmouse2
+modprobe hid_magicmouse2 2>/dev/null || true
@@ -0,0 +1,1096 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ *   Many-device benchmark for the hid-magicmouse2 driver over uhid
+ *
+ *   Creates emulated Magic Mouse 2 and Magic Trackpad 2 devices through
+ *   uhid, alternating between the two models, and lets the driver bind to
+ *   them. After each step that adds devices, every device replays the same
+ *   synthetic report trace from its own thread, all at once. A report counts
+ *   as delivered when its input frame can be read from the device's evdev
+ *   node; its latency is the time from the uhid write to that read.
+ *
+ *   For each step it prints the aggregate delivered reports per second,
+ *   the mean latency and the 99th percentile latency of the median and the
+ *   slowest device.
+ *
+ *   With -p, built with BPF=1, it creates all devices at once and replays
+ *   the trace twice: once as is, and once with the palm masking HID-BPF
+ *   sample from tools/hid-bpf attached to every device as its
+ *   hid_device_event program. The difference in latency is what the
+ *   program costs per report.
+ *
+ *   With -e it measures how fast a Magic Mouse 2 comes up when the
+ *   multitouch request fails: it answers the first N feature writes of a
+ *   fresh device with EIO, waits for one to succeed, sends touch reports
+ *   until a frame arrives, and prints the driver's probe timing from
+ *   debugfs. It then destroys the device and does it again, -c times.
+ *
+ *   With -t it instead replays a fixed Magic Mouse 2 trace on one device and
+ *   prints every input frame in a canonical form: pointer motion, left and
+ *   right button, and the contacts sorted by position. With -u it starts
+ *   the given magicmouse-uinput binary on the device's hidraw node and
+ *   prints the frames of its uinput device, so that the userspace driver
+ *   can be diffed against the kernel module on the same stream.
+ *
+ *   Usage: magicmouse-uhid-bench [-n devices] [-r reports] [-i interval_us]
+ *                                [-p]
+ *          magicmouse-uhid-bench -e errors [-c cycles]
+ *          magicmouse-uhid-bench -t [-u magicmouse-uinput]
+ *
+ *   Needs root, /dev/uhid and, except with -u, the hid_magicmouse2 module
+ *   loaded. -e also needs debugfs mounted.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+#include <linux/input.h>
+#include <linux/uhid.h>
+
+#include "hid-magicmouse2.h"
+
+#ifdef BENCH_BPF
+#include <bpf/libbpf.h>
+#include "magicmouse-mask-palms.skel.h"
+#endif
+
+#define BT_VENDOR_ID_APPLE			0x004c
+#define USB_DEVICE_ID_APPLE_MAGICMOUSE2		0x0269
+#define USB_DEVICE_ID_APPLE_MAGICTRACKPAD2	0x0265
+
+#define MAX_DEVICES		64
+/* A Magic Trackpad 2 report over Bluetooth: 4 byte header, 9 byte touches. */
+#define TRACKPAD2_HEADER_SIZE	4
+#define TRACKPAD2_TOUCH_SIZE	9
+
+/* How long to wait for the evdev node of a new device, and for the frame
+ * of one report before counting it as lost.
+ */
+#define BIND_TIMEOUT_MS		5000
+#define FRAME_TIMEOUT_MS	100
+/* In trace mode a report is done once its device stayed quiet this long. */
+#define TRACE_QUIET_MS		20
+/* How long -e waits for multitouch; the driver's retries back off to 1 s. */
+#define MT_ENABLE_TIMEOUT_MS	15000
+#define MAX_CYCLES		1000
+
+#define MAX_SLOTS		16
+#define TRACE_MAX_REPORTS	128
+
+struct bench_dev {
+	int index;
+	__u32 product;
+	int uhid;
+	int evdev;
+	pthread_t thread;
+	int started;
+	int x;
+	long long *latency_ns;
+	int delivered;
+	int lost;
+	int set_report_errors;
+	int mt_enabled;
+#ifdef BENCH_BPF
+	struct magicmouse_mask_palms *bpf;
+	struct bpf_link *bpf_link;
+#endif
+};
+
+static struct bench_dev devices[MAX_DEVICES];
+static pthread_barrier_t start_barrier;
+static int nreports = 2000;
+static long interval_us;
+
+/* Buttons and a relative X/Y pair under the report ID of the model, padded
+ * with vendor bytes. The driver decodes the raw reports itself; the
+ * descriptor only has to declare the report and give hid-input something
+ * to map so that an input device gets created.
+ */
+static const __u8 rdesc_template[] = {
+	0x05, 0x01,		/* Usage Page (Generic Desktop) */
+	0x09, 0x02,		/* Usage (Mouse) */
+	0xa1, 0x01,		/* Collection (Application) */
+	0x85, 0x00,		/*  Report ID, patched per model */
+	0x05, 0x09,		/*  Usage Page (Button) */
+	0x19, 0x01,		/*  Usage Minimum (1) */
+	0x29, 0x02,		/*  Usage Maximum (2) */
+	0x15, 0x00,		/*  Logical Minimum (0) */
+	0x25, 0x01,		/*  Logical Maximum (1) */
+	0x95, 0x02,		/*  Report Count (2) */
+	0x75, 0x01,		/*  Report Size (1) */
+	0x81, 0x02,		/*  Input (Data,Var,Abs) */
+	0x95, 0x01,		/*  Report Count (1) */
+	0x75, 0x06,		/*  Report Size (6) */
+	0x81, 0x03,		/*  Input (Cnst,Var,Abs) */
+	0x05, 0x01,		/*  Usage Page (Generic Desktop) */
+	0x09, 0x30,		/*  Usage (X) */
+	0x09, 0x31,		/*  Usage (Y) */
+	0x16, 0x01, 0x80,	/*  Logical Minimum (-32767) */
+	0x26, 0xff, 0x7f,	/*  Logical Maximum (32767) */
+	0x75, 0x10,		/*  Report Size (16) */
+	0x95, 0x02,		/*  Report Count (2) */
+	0x81, 0x06,		/*  Input (Data,Var,Rel) */
+	0x06, 0x00, 0xff,	/*  Usage Page (Vendor Defined) */
+	0x09, 0x01,		/*  Usage (1) */
+	0x15, 0x00,		/*  Logical Minimum (0) */
+	0x26, 0xff, 0x00,	/*  Logical Maximum (255) */
+	0x75, 0x08,		/*  Report Size (8) */
+	0x95, 0x08,		/*  Report Count (8) */
+	0x81, 0x02,		/*  Input (Data,Var,Abs) */
+	0xc0,			/* End Collection */
+};
+#define RDESC_REPORT_ID_OFFSET	7
+
+static long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int uhid_write(struct bench_dev *dev, const struct uhid_event *ev)
+{
+	if (write(dev->uhid, ev, sizeof(*ev)) != sizeof(*ev)) {
+		fprintf(stderr, "device %d: uhid write failed: %s\n",
+			dev->index, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/* Answer the requests the driver sends while it probes and enables
+ * multitouch: feature writes succeed, except for the first
+ * set_report_errors of them, and reads (battery) are refused.
+ */
+static void uhid_service(struct bench_dev *dev)
+{
+	struct uhid_event ev, reply;
+
+	while (read(dev->uhid, &ev, sizeof(ev)) > 0) {
+		memset(&reply, 0, sizeof(reply));
+		switch (ev.type) {
+		case UHID_SET_REPORT:
+			reply.type = UHID_SET_REPORT_REPLY;
+			reply.u.set_report_reply.id = ev.u.set_report.id;
+			if (dev->set_report_errors > 0) {
+				reply.u.set_report_reply.err = EIO;
+				dev->set_report_errors--;
+			} else {
+				dev->mt_enabled = 1;
+			}
+			uhid_write(dev, &reply);
+			break;
+		case UHID_GET_REPORT:
+			reply.type = UHID_GET_REPORT_REPLY;
+			reply.u.get_report_reply.id = ev.u.get_report.id;
+			reply.u.get_report_reply.err = EIO;
+			uhid_write(dev, &reply);
+			break;
+		default:
+			break;
+		}
+	}
+}
+
+/* Encode one touch record, the reverse of magicmouse_decode_touch(). */
+static void encode_touch(__u8 *tdata, int id, int x, int y, int state)
+{
+	int raw_y = -y & 0xfff;
+
+	tdata[0] = x & 0xff;
+	tdata[1] = (x >> 8 & 0x0f) | (raw_y & 0x0f) << 4;
+	tdata[2] = raw_y >> 4;
+	tdata[3] = 40;			/* touch major */
+	tdata[4] = 30;			/* touch minor */
+	tdata[5] = (id & 0x3) << 6 | 10;	/* size */
+	tdata[6] = 32 << 2 | (id >> 2 & 0x3);	/* orientation 0 */
+	tdata[7] = state;
+}
+
+/* One finger dragging left and right in the middle of the surface, and on
+ * the mouse a one unit jiggle of the pointer, so that every report changes
+ * the device state and produces exactly one input frame.
+ */
+static int build_report(struct bench_dev *dev, int seq, __u8 *data)
+{
+	int state = seq ? TOUCH_STATE_DRAG : TOUCH_STATE_START;
+	int step = seq & 1 ? 1 : -1;
+
+	dev->x += step * 40;
+
+	if (dev->product == USB_DEVICE_ID_APPLE_MAGICMOUSE2) {
+		memset(data, 0, MOUSE2_HEADER_SIZE);
+		data[0] = MOUSE2_REPORT_ID;
+		data[2] = step & 0xff;
+		data[3] = step < 0 ? 0xff : 0;
+		encode_touch(data + MOUSE2_HEADER_SIZE, 1, dev->x, 0, state);
+		return MOUSE2_HEADER_SIZE + MOUSE2_TOUCH_SIZE;
+	}
+
+	memset(data, 0, TRACKPAD2_HEADER_SIZE);
+	data[0] = TRACKPAD2_BT_REPORT_ID;
+	encode_touch(data + TRACKPAD2_HEADER_SIZE, 1, dev->x, 0, state);
+	data[TRACKPAD2_HEADER_SIZE + 8] = 40;	/* pressure */
+	return TRACKPAD2_HEADER_SIZE + TRACKPAD2_TOUCH_SIZE;
+}
+
+/* The driver renames a trackpad's input device, so look it up by the phys
+ * path hid-input copies from the HID device. A uinput device has no phys
+ * path and is matched by @name as well.
+ */
+static int find_evdev(const char *name, const char *phys)
+{
+	char evname[256], evphys[256];
+	glob_t g;
+	size_t ii;
+	int fd, clk = CLOCK_MONOTONIC;
+
+	if (glob("/dev/input/event*", 0, NULL, &g))
+		return -1;
+
+	for (ii = 0; ii < g.gl_pathc; ii++) {
+		fd = open(g.gl_pathv[ii], O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+		if (fd < 0)
+			continue;
+		memset(evname, 0, sizeof(evname));
+		memset(evphys, 0, sizeof(evphys));
+		ioctl(fd, EVIOCGNAME(sizeof(evname) - 1), evname);
+		ioctl(fd, EVIOCGPHYS(sizeof(evphys) - 1), evphys);
+		if (!strcmp(evphys, phys) && (!name || !strcmp(evname, name))) {
+			ioctl(fd, EVIOCSCLOCKID, &clk);
+			globfree(&g);
+			return fd;
+		}
+		close(fd);
+	}
+
+	globfree(&g);
+	return -1;
+}
+
+/* Serve the uhid device until the input device shows up. */
+static int bench_wait_evdev(struct bench_dev *dev, const char *name,
+		const char *phys)
+{
+	struct pollfd pfd = { .fd = dev->uhid, .events = POLLIN };
+	long long deadline = now_ns() + BIND_TIMEOUT_MS * 1000000LL;
+
+	while (now_ns() < deadline) {
+		poll(&pfd, 1, 10);
+		uhid_service(dev);
+		dev->evdev = find_evdev(name, phys);
+		if (dev->evdev >= 0)
+			return 0;
+	}
+	return -1;
+}
+
+static int bench_create(struct bench_dev *dev, int index)
+{
+	struct uhid_event ev;
+	struct uhid_create2_req *req = &ev.u.create2;
+
+	dev->index = index;
+	dev->uhid = -1;
+	dev->evdev = -1;
+	dev->product = index & 1 ? USB_DEVICE_ID_APPLE_MAGICTRACKPAD2 :
+				   USB_DEVICE_ID_APPLE_MAGICMOUSE2;
+	dev->latency_ns = calloc(nreports, sizeof(*dev->latency_ns));
+	if (!dev->latency_ns)
+		return -1;
+
+	dev->uhid = open("/dev/uhid", O_RDWR | O_NONBLOCK | O_CLOEXEC);
+	if (dev->uhid < 0) {
+		perror("/dev/uhid");
+		return -1;
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type = UHID_CREATE2;
+	snprintf((char *)req->name, sizeof(req->name),
+		 "magicmouse-uhid-bench %d", index);
+	snprintf((char *)req->phys, sizeof(req->phys),
+		 "magicmouse-uhid-bench/%d", index);
+	req->bus = BUS_BLUETOOTH;
+	req->vendor = BT_VENDOR_ID_APPLE;
+	req->product = dev->product;
+	req->rd_size = sizeof(rdesc_template);
+	memcpy(req->rd_data, rdesc_template, sizeof(rdesc_template));
+	req->rd_data[RDESC_REPORT_ID_OFFSET] =
+		dev->product == USB_DEVICE_ID_APPLE_MAGICMOUSE2 ?
+		MOUSE2_REPORT_ID : TRACKPAD2_BT_REPORT_ID;
+	if (uhid_write(dev, &ev))
+		return -1;
+
+	if (bench_wait_evdev(dev, NULL, (char *)req->phys) == 0)
+		return 0;
+
+	fprintf(stderr, "device %d: no input device, is hid_magicmouse2 loaded?\n",
+		index);
+	return -1;
+}
+
+static void bench_destroy(struct bench_dev *dev)
+{
+	struct uhid_event ev = { .type = UHID_DESTROY };
+
+	if (dev->evdev >= 0)
+		close(dev->evdev);
+	if (dev->uhid >= 0) {
+		uhid_write(dev, &ev);
+		close(dev->uhid);
+	}
+	free(dev->latency_ns);
+}
+
+/* Read input events until the frame of the last report ends. Returns 1 on
+ * SYN_REPORT, 0 when the device has nothing more to read.
+ */
+static int read_frame(struct bench_dev *dev)
+{
+	struct input_event ev;
+
+	while (read(dev->evdev, &ev, sizeof(ev)) == sizeof(ev)) {
+		if (ev.type != EV_SYN)
+			continue;
+		if (ev.code == SYN_REPORT)
+			return 1;
+		if (ev.code == SYN_DROPPED)
+			dev->lost++;
+	}
+	return 0;
+}
+
+static void *bench_replay(void *arg)
+{
+	struct bench_dev *dev = arg;
+	struct uhid_event ev;
+	struct pollfd pfd[2] = {
+		{ .fd = dev->uhid, .events = POLLIN },
+		{ .fd = dev->evdev, .events = POLLIN },
+	};
+	struct timespec next;
+	long long sent;
+	int seq, done;
+
+	dev->delivered = 0;
+	dev->lost = 0;
+
+	/* Drop anything left over from binding or an earlier step. */
+	while (read_frame(dev))
+		;
+
+	pthread_barrier_wait(&start_barrier);
+	clock_gettime(CLOCK_MONOTONIC, &next);
+
+	for (seq = 0; seq < nreports; seq++) {
+		memset(&ev, 0, sizeof(ev));
+		ev.type = UHID_INPUT2;
+		ev.u.input2.size = build_report(dev, dev->started + seq,
+						ev.u.input2.data);
+
+		sent = now_ns();
+		if (uhid_write(dev, &ev))
+			break;
+
+		for (done = 0; !done;) {
+			if (poll(pfd, 2, FRAME_TIMEOUT_MS) <= 0) {
+				dev->lost++;
+				break;
+			}
+			if (pfd[0].revents)
+				uhid_service(dev);
+			if (pfd[1].revents && read_frame(dev)) {
+				dev->latency_ns[dev->delivered++] =
+					now_ns() - sent;
+				done = 1;
+			}
+		}
+
+		if (interval_us) {
+			next.tv_nsec += interval_us * 1000;
+			next.tv_sec += next.tv_nsec / 1000000000L;
+			next.tv_nsec %= 1000000000L;
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next,
+					NULL);
+		}
+	}
+
+	dev->started += seq;
+	return NULL;
+}
+
+/* Trace mode. Each report carries pointer motion, buttons and up to two
+ * contacts. Finger drags stay below the scroll and swipe thresholds and
+ * clicks happen without a finger on the surface, so the kernel module
+ * produces no emulated wheel, middle button or navigation key from them.
+ */
+struct trace_touch {
+	int id;
+	int x;
+	int y;
+	int state;
+};
+
+struct trace_report {
+	int size;
+	__u8 data[MOUSE2_HEADER_SIZE + 2 * MOUSE2_TOUCH_SIZE];
+};
+
+static struct trace_report trace[TRACE_MAX_REPORTS];
+static int trace_len;
+
+static void trace_add(int dx, int dy, int buttons, int ntouches,
+		const struct trace_touch *touches)
+{
+	struct trace_report *r = &trace[trace_len++];
+	int ii;
+
+	memset(r, 0, sizeof(*r));
+	r->data[0] = MOUSE2_REPORT_ID;
+	r->data[1] = buttons;
+	r->data[2] = dx & 0xff;
+	r->data[3] = dx >> 8 & 0xff;
+	r->data[4] = dy & 0xff;
+	r->data[5] = dy >> 8 & 0xff;
+	for (ii = 0; ii < ntouches; ii++)
+		encode_touch(r->data + MOUSE2_HEADER_SIZE +
+			     ii * MOUSE2_TOUCH_SIZE, touches[ii].id,
+			     touches[ii].x, touches[ii].y, touches[ii].state);
+	r->size = MOUSE2_HEADER_SIZE + ntouches * MOUSE2_TOUCH_SIZE;
+}
+
+static void trace_build(void)
+{
+	struct trace_touch t[2];
+	int ii, k;
+
+	/* Pointer motion, then a left and a right click. */
+	for (ii = 0; ii < 8; ii++)
+		trace_add(3, -2, 0, 0, NULL);
+	for (ii = 0; ii < 4; ii++)
+		trace_add(0, 0, ii < 3 ? 1 : 0, 0, NULL);
+	for (ii = 0; ii < 4; ii++)
+		trace_add(0, 0, ii < 3 ? 2 : 0, 0, NULL);
+
+	/* One finger drags while the mouse moves, a second one joins. */
+	t[0] = (struct trace_touch){ 1, -600, 300, TOUCH_STATE_START };
+	trace_add(1, 0, 0, 1, t);
+	t[0].state = TOUCH_STATE_DRAG;
+	for (ii = 0; ii < 7; ii++) {
+		t[0].x += 20;
+		trace_add(1, 0, 0, 1, t);
+	}
+	t[1] = (struct trace_touch){ 2, 400, -200, TOUCH_STATE_START };
+	trace_add(0, 0, 0, 2, t);
+	t[1].state = TOUCH_STATE_DRAG;
+	for (ii = 0; ii < 6; ii++) {
+		t[1].x += 15;
+		trace_add(0, 1, 0, 2, t);
+	}
+
+	/* The first finger lifts, then the second. */
+	t[0].state = TOUCH_STATE_NONE;
+	trace_add(0, 0, 0, 2, t);
+	t[0] = t[1];
+	for (ii = 0; ii < 3; ii++) {
+		t[0].x += 15;
+		trace_add(0, 0, 0, 1, t);
+	}
+	t[0].state = TOUCH_STATE_NONE;
+	trace_add(0, 0, 0, 1, t);
+
+	/* More separate touches than a mouse has slots. */
+	for (k = 0; k < 7; k++) {
+		t[0] = (struct trace_touch){ 3 + k, -300 + 80 * k, 100,
+					     TOUCH_STATE_START };
+		trace_add(0, 0, 0, 1, t);
+		t[0].state = TOUCH_STATE_DRAG;
+		for (ii = 0; ii < 2; ii++) {
+			t[0].x += 10;
+			trace_add(0, 0, 0, 1, t);
+		}
+		t[0].state = TOUCH_STATE_NONE;
+		trace_add(0, 0, 0, 1, t);
+	}
+}
+
+/* Input state as seen by one evdev client, printed once per frame. */
+struct trace_state {
+	int slot;
+	int active[MAX_SLOTS];
+	int abs[MAX_SLOTS][5];	/* x, y, major, minor, orientation */
+	int rel_x;
+	int rel_y;
+	int left;
+	int right;
+	int changed;
+};
+
+static int cmp_contact(const void *a, const void *b)
+{
+	const int *x = a, *y = b;
+	int ii;
+
+	for (ii = 0; ii < 5; ii++)
+		if (x[ii] != y[ii])
+			return x[ii] < y[ii] ? -1 : 1;
+	return 0;
+}
+
+static void trace_frame(struct trace_state *st)
+{
+	int contacts[MAX_SLOTS][5];
+	int ii, n = 0;
+
+	for (ii = 0; ii < MAX_SLOTS; ii++)
+		if (st->active[ii])
+			memcpy(contacts[n++], st->abs[ii], sizeof(contacts[0]));
+	qsort(contacts, n, sizeof(contacts[0]), cmp_contact);
+
+	printf("rel %d %d btn %d %d", st->rel_x, st->rel_y, st->left,
+	       st->right);
+	for (ii = 0; ii < n; ii++)
+		printf(" (%d,%d,%d,%d,%d)", contacts[ii][0], contacts[ii][1],
+		       contacts[ii][2], contacts[ii][3], contacts[ii][4]);
+	printf("\n");
+
+	st->rel_x = 0;
+	st->rel_y = 0;
+	st->changed = 0;
+}
+
+static void trace_event(struct trace_state *st, const struct input_event *ev)
+{
+	static const int mt_codes[5] = {
+		ABS_MT_POSITION_X, ABS_MT_POSITION_Y, ABS_MT_TOUCH_MAJOR,
+		ABS_MT_TOUCH_MINOR, ABS_MT_ORIENTATION,
+	};
+	int ii;
+
+	switch (ev->type) {
+	case EV_SYN:
+		if (ev->code == SYN_REPORT && st->changed)
+			trace_frame(st);
+		else if (ev->code == SYN_DROPPED)
+			printf("dropped\n");
+		break;
+	case EV_KEY:
+		if (ev->code == BTN_LEFT)
+			st->left = ev->value;
+		else if (ev->code == BTN_RIGHT)
+			st->right = ev->value;
+		else
+			break;
+		st->changed = 1;
+		break;
+	case EV_REL:
+		if (ev->code == REL_X)
+			st->rel_x += ev->value;
+		else if (ev->code == REL_Y)
+			st->rel_y += ev->value;
+		else
+			break;
+		st->changed = 1;
+		break;
+	case EV_ABS:
+		if (ev->code == ABS_MT_SLOT) {
+			st->slot = ev->value;
+			break;
+		}
+		if (st->slot < 0 || st->slot >= MAX_SLOTS)
+			break;
+		if (ev->code == ABS_MT_TRACKING_ID) {
+			st->active[st->slot] = ev->value >= 0;
+			st->changed = 1;
+			break;
+		}
+		for (ii = 0; ii < 5; ii++) {
+			if (ev->code == mt_codes[ii]) {
+				st->abs[st->slot][ii] = ev->value;
+				st->changed = 1;
+			}
+		}
+		break;
+	}
+}
+
+/* Serve the device and print its frames until it stays quiet. */
+static void trace_drain(struct bench_dev *dev, struct trace_state *st)
+{
+	struct pollfd pfd[2] = {
+		{ .fd = dev->uhid, .events = POLLIN },
+		{ .fd = dev->evdev, .events = POLLIN },
+	};
+	struct input_event ev;
+
+	while (poll(pfd, 2, TRACE_QUIET_MS) > 0) {
+		uhid_service(dev);
+		while (read(dev->evdev, &ev, sizeof(ev)) == sizeof(ev))
+			trace_event(st, &ev);
+	}
+}
+
+/* Find the uevent file among @pattern that belongs to the uhid device
+ * with @phys, and read the name @format picks from its path into @name.
+ */
+static int find_uevent(const char *pattern, const char *format,
+		const char *phys, char *name)
+{
+	char line[256], want[256];
+	glob_t g;
+	size_t ii;
+	FILE *f;
+	int found = 0;
+
+	snprintf(want, sizeof(want), "HID_PHYS=%s\n", phys);
+	if (glob(pattern, 0, NULL, &g))
+		return -1;
+
+	for (ii = 0; ii < g.gl_pathc && !found; ii++) {
+		f = fopen(g.gl_pathv[ii], "r");
+		if (!f)
+			continue;
+		while (!found && fgets(line, sizeof(line), f))
+			found = !strcmp(line, want);
+		fclose(f);
+		if (found)
+			found = sscanf(g.gl_pathv[ii], format, name) == 1;
+	}
+
+	globfree(&g);
+	return found ? 0 : -1;
+}
+
+/* Find the hidraw node of the uhid device by its phys path. */
+static int find_hidraw(const char *phys, char *path, size_t len)
+{
+	char node[32];
+
+	if (find_uevent("/sys/class/hidraw/hidraw*/device/uevent",
+			"/sys/class/hidraw/%31[^/]", phys, node))
+		return -1;
+
+	snprintf(path, len, "/dev/%s", node);
+	return 0;
+}
+
+/* The HID device name of the uhid device, e.g. 0005:004C:0269.000A, as
+ * used for its debugfs directory. The number after the dot is its HID-BPF
+ * hid_id.
+ */
+static int find_hid_name(const struct bench_dev *dev, char *name)
+{
+	char phys[64];
+
+	snprintf(phys, sizeof(phys), "magicmouse-uhid-bench/%d", dev->index);
+	return find_uevent("/sys/bus/hid/devices/*/uevent",
+			   "/sys/bus/hid/devices/%31[^/]", phys, name);
+}
+
+#ifdef BENCH_BPF
+static int bench_attach_bpf(struct bench_dev *dev)
+{
+	char name[32];
+	unsigned int hid_id;
+
+	if (find_hid_name(dev, name) ||
+	    sscanf(name, "%*x:%*x:%*x.%x", &hid_id) != 1) {
+		fprintf(stderr, "device %d: no HID device found\n", dev->index);
+		return -1;
+	}
+
+	dev->bpf = magicmouse_mask_palms__open();
+	if (!dev->bpf)
+		goto err;
+	dev->bpf->struct_ops.magicmouse_mask_palms->hid_id = hid_id;
+	if (magicmouse_mask_palms__load(dev->bpf))
+		goto err;
+
+	dev->bpf_link =
+		bpf_map__attach_struct_ops(dev->bpf->maps.magicmouse_mask_palms);
+	if (!dev->bpf_link)
+		goto err;
+	return 0;
+err:
+	fprintf(stderr, "device %d: unable to attach the HID-BPF program: %s\n",
+		dev->index, strerror(errno));
+	magicmouse_mask_palms__destroy(dev->bpf);
+	dev->bpf = NULL;
+	return -1;
+}
+
+static void bench_detach_bpf(struct bench_dev *dev)
+{
+	bpf_link__destroy(dev->bpf_link);
+	magicmouse_mask_palms__destroy(dev->bpf);
+	dev->bpf_link = NULL;
+	dev->bpf = NULL;
+}
+#endif
+
+static int trace_run(const char *daemon)
+{
+	struct bench_dev *dev = &devices[0];
+	struct trace_state st = { 0 };
+	struct input_absinfo slot;
+	struct uhid_event ev;
+	char hidraw[64], name[64], phys[64];
+	pid_t pid = -1;
+	int ii, ret = -1;
+
+	trace_build();
+	if (bench_create(dev, 0))
+		goto out;
+	snprintf(name, sizeof(name), "magicmouse-uhid-bench %d", dev->index);
+	snprintf(phys, sizeof(phys), "magicmouse-uhid-bench/%d", dev->index);
+
+	if (daemon) {
+		if (find_hidraw(phys, hidraw, sizeof(hidraw))) {
+			fprintf(stderr, "no hidraw node for %s\n", phys);
+			goto out;
+		}
+
+		pid = fork();
+		if (pid == 0) {
+			execl(daemon, daemon, hidraw, (char *)NULL);
+			perror(daemon);
+			_exit(1);
+		}
+
+		close(dev->evdev);
+		dev->evdev = -1;
+		if (pid < 0 || bench_wait_evdev(dev, name, "")) {
+			fprintf(stderr, "%s did not create its device\n", daemon);
+			goto out;
+		}
+	}
+
+	/* Let the multitouch enable go through before the trace starts. */
+	trace_drain(dev, &st);
+	if (ioctl(dev->evdev, EVIOCGABS(ABS_MT_SLOT), &slot) == 0)
+		st.slot = slot.value;
+
+	for (ii = 0; ii < trace_len; ii++) {
+		memset(&ev, 0, sizeof(ev));
+		ev.type = UHID_INPUT2;
+		ev.u.input2.size = trace[ii].size;
+		memcpy(ev.u.input2.data, trace[ii].data, trace[ii].size);
+		if (uhid_write(dev, &ev))
+			goto out;
+		trace_drain(dev, &st);
+	}
+	ret = 0;
+
+out:
+	if (pid > 0) {
+		kill(pid, SIGTERM);
+		waitpid(pid, NULL, 0);
+	}
+	bench_destroy(dev);
+	return ret ? 1 : 0;
+}
+
+static int cmp_ll(const void *a, const void *b)
+{
+	long long x = *(const long long *)a, y = *(const long long *)b;
+
+	return (x > y) - (x < y);
+}
+
+static long long p99(struct bench_dev *dev)
+{
+	if (!dev->delivered)
+		return 0;
+	qsort(dev->latency_ns, dev->delivered, sizeof(long long), cmp_ll);
+	return dev->latency_ns[(dev->delivered - 1) * 99 / 100];
+}
+
+static void bench_header(const char *run)
+{
+	printf("%-9s %7s %12s %10s %14s %14s %8s\n", run, "devices",
+	       "reports/s", "mean us", "p99 median us", "p99 worst us", "lost");
+}
+
+static int bench_step(const char *run, int ndev)
+{
+	long long start, elapsed, per_dev[MAX_DEVICES], sum = 0;
+	long total = 0, lost = 0;
+	int ii, jj;
+
+	pthread_barrier_init(&start_barrier, NULL, ndev + 1);
+	for (ii = 0; ii < ndev; ii++) {
+		if (pthread_create(&devices[ii].thread, NULL, bench_replay,
+				   &devices[ii])) {
+			fprintf(stderr, "unable to start replay threads\n");
+			exit(1);
+		}
+	}
+
+	pthread_barrier_wait(&start_barrier);
+	start = now_ns();
+	for (ii = 0; ii < ndev; ii++)
+		pthread_join(devices[ii].thread, NULL);
+	elapsed = now_ns() - start;
+	pthread_barrier_destroy(&start_barrier);
+
+	for (ii = 0; ii < ndev; ii++) {
+		total += devices[ii].delivered;
+		lost += devices[ii].lost;
+		for (jj = 0; jj < devices[ii].delivered; jj++)
+			sum += devices[ii].latency_ns[jj];
+		per_dev[ii] = p99(&devices[ii]);
+	}
+	qsort(per_dev, ndev, sizeof(per_dev[0]), cmp_ll);
+
+	printf("%-9s %7d %12.0f %10.1f %14.1f %14.1f %8ld\n", run, ndev,
+	       total * 1e9 / elapsed, total ? sum / 1e3 / total : 0.0,
+	       per_dev[(ndev - 1) / 2] / 1e3, per_dev[ndev - 1] / 1e3, lost);
+	fflush(stdout);
+	return 0;
+}
+
+/* Replay on all devices without and then with the HID-BPF program. */
+static int bpf_run(int ndevices)
+{
+#ifdef BENCH_BPF
+	int ii, attached;
+
+	bench_header("bpf");
+	bench_step("detached", ndevices);
+
+	for (attached = 0; attached < ndevices; attached++)
+		if (bench_attach_bpf(&devices[attached]))
+			break;
+	if (attached == ndevices)
+		bench_step("attached", ndevices);
+
+	for (ii = 0; ii < attached; ii++)
+		bench_detach_bpf(&devices[ii]);
+	return attached == ndevices ? 0 : -1;
+#else
+	(void)ndevices;
+	fprintf(stderr, "built without HID-BPF support, rebuild with make BPF=1\n");
+	return -1;
+#endif
+}
+
+/* The times of the probe phases in microseconds, -1 for phases the
+ * device has not reached, and the number of multitouch retries.
+ */
+struct probe_timing {
+	long long mt_enable;
+	long long first_touch;
+	int mt_retries;
+};
+
+static int read_probe_timing(struct bench_dev *dev, struct probe_timing *t)
+{
+	char name[32], path[128], line[64], phase[16];
+	long long value;
+	FILE *f;
+
+	if (find_hid_name(dev, name))
+		return -1;
+	snprintf(path, sizeof(path),
+		 "/sys/kernel/debug/magicmouse/%s/probe_timing", name);
+	f = fopen(path, "r");
+	if (!f) {
+		perror(path);
+		return -1;
+	}
+
+	t->mt_enable = -1;
+	t->first_touch = -1;
+	t->mt_retries = -1;
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "%15s %lld", phase, &value) != 2)
+			continue;
+		if (!strcmp(phase, "mt_enable"))
+			t->mt_enable = value;
+		else if (!strcmp(phase, "first_touch"))
+			t->first_touch = value;
+		else if (!strcmp(phase, "mt_retries"))
+			t->mt_retries = value;
+	}
+
+	fclose(f);
+	return 0;
+}
+
+/* Bring up one Magic Mouse 2 whose first @nerrors multitouch requests
+ * fail, and time it until its first touch frame.
+ */
+static int reconnect_cycle(struct bench_dev *dev, int nerrors,
+		struct probe_timing *t)
+{
+	struct pollfd pfd = { .fd = -1, .events = POLLIN };
+	struct uhid_event ev;
+	long long deadline;
+	int seq = 0;
+
+	memset(dev, 0, sizeof(*dev));
+	dev->set_report_errors = nerrors;
+	if (bench_create(dev, 0))
+		return -1;
+
+	/* A real device only sends touches once multitouch is on. */
+	pfd.fd = dev->uhid;
+	deadline = now_ns() + MT_ENABLE_TIMEOUT_MS * 1000000LL;
+	while (!dev->mt_enabled && now_ns() < deadline) {
+		poll(&pfd, 1, 10);
+		uhid_service(dev);
+	}
+	if (!dev->mt_enabled) {
+		fprintf(stderr, "multitouch not enabled after %d errors\n",
+			nerrors);
+		return -1;
+	}
+
+	/* Drop the frames of binding, then send touches until one comes
+	 * through.
+	 */
+	while (read_frame(dev))
+		;
+	pfd.fd = dev->evdev;
+	while (seq < nreports) {
+		memset(&ev, 0, sizeof(ev));
+		ev.type = UHID_INPUT2;
+		ev.u.input2.size = build_report(dev, seq++, ev.u.input2.data);
+		if (uhid_write(dev, &ev))
+			return -1;
+		if (poll(&pfd, 1, FRAME_TIMEOUT_MS) > 0 && read_frame(dev))
+			break;
+		uhid_service(dev);
+	}
+
+	return read_probe_timing(dev, t);
+}
+
+static int reconnect_run(int nerrors, int ncycles)
+{
+	long long first_touch[MAX_CYCLES];
+	struct probe_timing t;
+	int ii, n = 0;
+
+	printf("%5s %6s %14s %15s %10s\n", "cycle", "errors",
+	       "mt_enable us", "first_touch us", "mt_retries");
+
+	for (ii = 0; ii < ncycles; ii++) {
+		if (reconnect_cycle(&devices[0], nerrors, &t)) {
+			bench_destroy(&devices[0]);
+			return -1;
+		}
+		bench_destroy(&devices[0]);
+
+		printf("%5d %6d %14lld %15lld %10d\n", ii, nerrors,
+		       t.mt_enable, t.first_touch, t.mt_retries);
+		if (t.first_touch >= 0)
+			first_touch[n++] = t.first_touch;
+	}
+
+	if (n) {
+		qsort(first_touch, n, sizeof(first_touch[0]), cmp_ll);
+		printf("first_touch median %lld us, worst %lld us\n",
+		       first_touch[(n - 1) / 2], first_touch[n - 1]);
+	}
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	int ndevices = 32, step, ii = 0, opt, trace_mode = 0, bpf_mode = 0;
+	int nerrors = -1, ncycles = 10;
+	const char *daemon = NULL;
+	int ret = 0;
+
+	while ((opt = getopt(argc, argv, "n:r:i:pe:c:tu:")) != -1) {
+		switch (opt) {
+		case 'e':
+			nerrors = atoi(optarg);
+			break;
+		case 'c':
+			ncycles = atoi(optarg);
+			break;
+		case 'p':
+			bpf_mode = 1;
+			break;
+		case 't':
+			trace_mode = 1;
+			break;
+		case 'u':
+			trace_mode = 1;
+			daemon = optarg;
+			break;
+		case 'n':
+			ndevices = atoi(optarg);
+			break;
+		case 'r':
+			nreports = atoi(optarg);
+			break;
+		case 'i':
+			interval_us = atol(optarg);
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (ndevices < 1 || ndevices > MAX_DEVICES || nreports < 1 ||
+	    interval_us < 0 || ncycles < 1 || ncycles > MAX_CYCLES)
+		goto usage;
+
+	if (trace_mode)
+		return trace_run(daemon);
+	if (nerrors >= 0)
+		return reconnect_run(nerrors, ncycles) ? 1 : 0;
+
+	if (bpf_mode) {
+		for (ii = 0; ii < ndevices; ii++) {
+			if (bench_create(&devices[ii], ii)) {
+				ndevices = ii + 1;
+				ret = -1;
+				goto out;
+			}
+		}
+		ret = bpf_run(ndevices);
+		goto out;
+	}
+
+	bench_header("run");
+
+	/* Add devices in doubling steps, ending with all of them. */
+	for (step = 1; ; step = step * 2 < ndevices ? step * 2 : ndevices) {
+		for (; ii < step; ii++) {
+			if (bench_create(&devices[ii], ii)) {
+				ndevices = ii + 1;
+				goto out;
+			}
+		}
+		bench_step("step", step);
+		if (step == ndevices)
+			break;
+	}
+
+out:
+	for (ii = 0; ii < ndevices; ii++)
+		bench_destroy(&devices[ii]);
+	return ret ? 1 : 0;
+
+usage:
+	fprintf(stderr, "usage: %s [-n devices (1-%d)] [-r reports] [-i interval_us] [-p]\n"
+		"       %s -e errors [-c cycles (1-%d)]\n"
+		"       %s -t [-u magicmouse-uinput]\n",
+		argv[0], MAX_DEVICES, argv[0], MAX_CYCLES, argv[0]);
+	return 1;
+}
@@ -0,0 +1,412 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ *   Userspace Magic Mouse 2 driver over hidraw and uinput
+ *
+ *   For systems where the hid-magicmouse2 module cannot be built or loaded.
+ *   Switches each mouse into multitouch mode, decodes its reports with the
+ *   layouts the kernel driver uses (hid-magicmouse2.h) and replays them
+ *   through a uinput device with pointer motion, the left and right
+ *   buttons and multitouch contacts, on as many MT slots as the kernel
+ *   driver gives a mouse. It has none of the driver's emulation: no
+ *   middle button, no scroll wheel, no tap, swipe or palm rejection.
+ *   All devices are served from one thread through epoll.
+ *
+ *   Usage: magicmouse-uinput /dev/hidrawN [/dev/hidrawM ...]
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <linux/hidraw.h>
+#include <linux/input.h>
+#include <linux/uinput.h>
+
+#include "hid-magicmouse2.h"
+
+#define BT_VENDOR_ID_APPLE			0x004c
+#define USB_DEVICE_ID_APPLE_MAGICMOUSE2		0x0269
+
+#define MAX_DEVICES		16
+#define REPORT_SIZE		256
+/* Reports drained per device and wakeup before others get a turn. */
+#define REPORT_BATCH		32
+
+/* Multitouch enable retries, as in the kernel driver. */
+#define MT_ENABLE_DELAY_MS	20
+#define MT_ENABLE_DELAY_MAX_MS	1000
+#define MT_ENABLE_ATTEMPTS	10
+
+struct mm_device {
+	int hidraw;
+	int uinput;
+	const char *path;
+	int mt_active;
+	int mt_attempts;
+	unsigned int mt_delay_ms;
+	long long mt_retry_ms;	/* next enable attempt, -1 if none */
+	/* MT slots, handed out by touch ID like input_mt_get_slot_by_key() */
+	int slot_key[MOUSE_MT_SLOTS];
+	int tracking_id[MOUSE_MT_SLOTS];
+	unsigned int slot_frame[MOUSE_MT_SLOTS];
+	unsigned int frame;
+	int next_tracking_id;
+	struct input_event events[16 + MOUSE2_MAX_TOUCHES * 8];
+	int nevents;
+};
+
+static struct mm_device devices[MAX_DEVICES];
+
+static long long mm_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static void mm_event(struct mm_device *dev, int type, int code, int value)
+{
+	struct input_event *ev = &dev->events[dev->nevents++];
+
+	memset(ev, 0, sizeof(*ev));
+	ev->type = type;
+	ev->code = code;
+	ev->value = value;
+}
+
+/* One attempt at switching the mouse into multitouch mode. Like the
+ * kernel driver, an EIO is retried with a growing delay until touch data
+ * arrives, and the device is kept even when every attempt fails, with
+ * pointer motion and buttons still working. Retries are run from the
+ * main loop once mt_retry_ms has passed.
+ */
+static void mm_enable_multitouch(struct mm_device *dev)
+{
+	const __u8 feature[] = MOUSE2_FEATURE_MT;
+	__u8 buf[sizeof(feature)];
+
+	dev->mt_retry_ms = -1;
+	if (dev->mt_active)
+		return;
+
+	memcpy(buf, feature, sizeof(buf));
+	if (ioctl(dev->hidraw, HIDIOCSFEATURE(sizeof(buf)), buf) >= 0)
+		return;
+
+	if (errno != EIO || ++dev->mt_attempts >= MT_ENABLE_ATTEMPTS) {
+		fprintf(stderr, "%s: unable to request touch data: %s\n",
+			dev->path, strerror(errno));
+		return;
+	}
+
+	dev->mt_retry_ms = mm_now_ms() + dev->mt_delay_ms;
+	if (dev->mt_delay_ms * 2 < MT_ENABLE_DELAY_MAX_MS)
+		dev->mt_delay_ms *= 2;
+	else
+		dev->mt_delay_ms = MT_ENABLE_DELAY_MAX_MS;
+}
+
+/* The slot of an active contact with touch ID @key, else, if @start, a
+ * free slot that was not used in the current frame. As in the kernel, a
+ * contact that finds no slot is not reported. Returns -1 if none.
+ */
+static int mm_get_slot(struct mm_device *dev, int key, int start)
+{
+	int ii;
+
+	for (ii = 0; ii < MOUSE_MT_SLOTS; ii++)
+		if (dev->tracking_id[ii] >= 0 && dev->slot_key[ii] == key)
+			return ii;
+
+	if (!start)
+		return -1;
+
+	for (ii = 0; ii < MOUSE_MT_SLOTS; ii++) {
+		if (dev->tracking_id[ii] < 0 &&
+		    dev->slot_frame[ii] != dev->frame) {
+			dev->slot_key[ii] = key;
+			return ii;
+		}
+	}
+
+	return -1;
+}
+
+static int mm_abs_setup(int fd, int code, int min, int max, int fuzz,
+		int res)
+{
+	struct uinput_abs_setup abs = {
+		.code = code,
+		.absinfo = {
+			.minimum = min,
+			.maximum = max,
+			.fuzz = fuzz,
+			.resolution = res,
+		},
+	};
+
+	if (ioctl(fd, UI_SET_ABSBIT, code) < 0)
+		return -1;
+	return ioctl(fd, UI_ABS_SETUP, &abs);
+}
+
+/* The capabilities magicmouse_setup_input() gives a Magic Mouse 2 with
+ * emulate_3button, emulate_scroll_wheel, tap_to_click and
+ * swipe_navigation all off.
+ */
+static int mm_create_uinput(const char *name,
+		const struct hidraw_devinfo *info)
+{
+	struct uinput_setup setup = { 0 };
+	int fd;
+
+	fd = open("/dev/uinput", O_WRONLY | O_NONBLOCK);
+	if (fd < 0)
+		return -1;
+
+	if (ioctl(fd, UI_SET_EVBIT, EV_KEY) < 0 ||
+	    ioctl(fd, UI_SET_KEYBIT, BTN_LEFT) < 0 ||
+	    ioctl(fd, UI_SET_KEYBIT, BTN_RIGHT) < 0 ||
+	    ioctl(fd, UI_SET_EVBIT, EV_REL) < 0 ||
+	    ioctl(fd, UI_SET_RELBIT, REL_X) < 0 ||
+	    ioctl(fd, UI_SET_RELBIT, REL_Y) < 0 ||
+	    ioctl(fd, UI_SET_EVBIT, EV_ABS) < 0 ||
+	    mm_abs_setup(fd, ABS_MT_SLOT, 0, MOUSE_MT_SLOTS - 1, 0, 0) < 0 ||
+	    mm_abs_setup(fd, ABS_MT_TRACKING_ID, 0, 65535, 0, 0) < 0 ||
+	    mm_abs_setup(fd, ABS_MT_TOUCH_MAJOR, 0, 255 << 2, 4, 0) < 0 ||
+	    mm_abs_setup(fd, ABS_MT_TOUCH_MINOR, 0, 255 << 2, 4, 0) < 0 ||
+	    mm_abs_setup(fd, ABS_MT_ORIENTATION, -31, 32, 1, 0) < 0 ||
+	    mm_abs_setup(fd, ABS_MT_POSITION_X, MOUSE_MIN_X, MOUSE_MAX_X, 4,
+			 MOUSE_RES_X) < 0 ||
+	    mm_abs_setup(fd, ABS_MT_POSITION_Y, MOUSE_MIN_Y, MOUSE_MAX_Y, 4,
+			 MOUSE_RES_Y) < 0)
+		goto err;
+
+	setup.id.bustype = info->bustype;
+	setup.id.vendor = info->vendor;
+	setup.id.product = info->product;
+	snprintf(setup.name, sizeof(setup.name), "%s", name);
+
+	if (ioctl(fd, UI_DEV_SETUP, &setup) < 0 ||
+	    ioctl(fd, UI_DEV_CREATE) < 0)
+		goto err;
+
+	return fd;
+err:
+	close(fd);
+	return -1;
+}
+
+/* Decode one Magic Mouse 2 report, the way magicmouse_raw_event() does. */
+static void mm_handle_report(struct mm_device *dev, const __u8 *data,
+		int size)
+{
+	struct magicmouse_touch touch;
+	int ii, npoints, slot, x, y;
+
+	if (size < MOUSE2_HEADER_SIZE || data[0] != MOUSE2_REPORT_ID ||
+	    (size - MOUSE2_HEADER_SIZE) % MOUSE2_TOUCH_SIZE != 0)
+		return;
+	npoints = (size - MOUSE2_HEADER_SIZE) / MOUSE2_TOUCH_SIZE;
+	if (npoints > MOUSE2_MAX_TOUCHES)
+		return;
+
+	/* Touch data only arrives once multitouch is on. */
+	if (npoints > 0 && !dev->mt_active) {
+		dev->mt_active = 1;
+		dev->mt_retry_ms = -1;
+	}
+
+	dev->nevents = 0;
+	for (ii = 0; ii < npoints; ii++) {
+		magicmouse_decode_touch(data + MOUSE2_HEADER_SIZE +
+					ii * MOUSE2_TOUCH_SIZE, &touch);
+
+		slot = mm_get_slot(dev, touch.id,
+				   touch.state != TOUCH_STATE_NONE);
+		if (slot < 0)
+			continue;
+
+		dev->slot_frame[slot] = dev->frame;
+		mm_event(dev, EV_ABS, ABS_MT_SLOT, slot);
+		if (touch.state == TOUCH_STATE_NONE) {
+			dev->tracking_id[slot] = -1;
+			mm_event(dev, EV_ABS, ABS_MT_TRACKING_ID, -1);
+			continue;
+		}
+
+		if (dev->tracking_id[slot] < 0) {
+			dev->tracking_id[slot] = dev->next_tracking_id;
+			dev->next_tracking_id = (dev->next_tracking_id + 1) & 0xffff;
+			mm_event(dev, EV_ABS, ABS_MT_TRACKING_ID,
+				 dev->tracking_id[slot]);
+		}
+		mm_event(dev, EV_ABS, ABS_MT_TOUCH_MAJOR, touch.touch_major << 2);
+		mm_event(dev, EV_ABS, ABS_MT_TOUCH_MINOR, touch.touch_minor << 2);
+		mm_event(dev, EV_ABS, ABS_MT_ORIENTATION, -touch.orientation);
+		mm_event(dev, EV_ABS, ABS_MT_POSITION_X, touch.x);
+		mm_event(dev, EV_ABS, ABS_MT_POSITION_Y, touch.y);
+	}
+
+	magicmouse2_decode_motion(data, &x, &y);
+	mm_event(dev, EV_KEY, BTN_LEFT, data[1] & 1);
+	mm_event(dev, EV_KEY, BTN_RIGHT, data[1] & 2);
+	mm_event(dev, EV_REL, REL_X, x);
+	mm_event(dev, EV_REL, REL_Y, y);
+	mm_event(dev, EV_SYN, SYN_REPORT, 0);
+	dev->frame++;
+
+	/* One write per report; uinput takes the whole frame at once. */
+	if (write(dev->uinput, dev->events,
+		  dev->nevents * sizeof(dev->events[0])) < 0)
+		fprintf(stderr, "%s: uinput write failed: %s\n", dev->path,
+			strerror(errno));
+}
+
+static int mm_open(struct mm_device *dev, const char *path, int epfd)
+{
+	struct epoll_event ev = { .events = EPOLLIN };
+	struct hidraw_devinfo info;
+	char name[UINPUT_MAX_NAME_SIZE] = "";
+	int ii;
+
+	dev->path = path;
+	dev->hidraw = open(path, O_RDWR | O_NONBLOCK);
+	if (dev->hidraw < 0) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	if (ioctl(dev->hidraw, HIDIOCGRAWINFO, &info) < 0 ||
+	    (__u16)info.vendor != BT_VENDOR_ID_APPLE ||
+	    (__u16)info.product != USB_DEVICE_ID_APPLE_MAGICMOUSE2) {
+		fprintf(stderr, "%s: not a Magic Mouse 2\n", path);
+		goto err;
+	}
+	ioctl(dev->hidraw, HIDIOCGRAWNAME(sizeof(name) - 1), name);
+
+	for (ii = 0; ii < MOUSE_MT_SLOTS; ii++) {
+		dev->tracking_id[ii] = -1;
+		dev->slot_frame[ii] = 0;
+	}
+	dev->frame = 1;
+	dev->mt_active = 0;
+	dev->mt_attempts = 0;
+	dev->mt_delay_ms = MT_ENABLE_DELAY_MS;
+
+	dev->uinput = mm_create_uinput(name, &info);
+	if (dev->uinput < 0) {
+		fprintf(stderr, "%s: unable to create uinput device: %s\n",
+			path, strerror(errno));
+		goto err;
+	}
+
+	ev.data.ptr = dev;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, dev->hidraw, &ev) < 0)
+		goto err_uinput;
+
+	mm_enable_multitouch(dev);
+	return 0;
+err_uinput:
+	ioctl(dev->uinput, UI_DEV_DESTROY);
+	close(dev->uinput);
+err:
+	close(dev->hidraw);
+	dev->hidraw = -1;
+	return -1;
+}
+
+/* Run due multitouch enable retries and return the epoll timeout until
+ * the next one, or -1 if none is pending.
+ */
+static int mm_retry_multitouch(int ndevices)
+{
+	long long now = mm_now_ms(), next = -1;
+	int ii;
+
+	for (ii = 0; ii < ndevices; ii++) {
+		struct mm_device *dev = &devices[ii];
+
+		if (dev->hidraw < 0 || dev->mt_retry_ms < 0)
+			continue;
+		if (dev->mt_retry_ms <= now)
+			mm_enable_multitouch(dev);
+		if (dev->mt_retry_ms >= 0 &&
+		    (next < 0 || dev->mt_retry_ms < next))
+			next = dev->mt_retry_ms;
+	}
+
+	return next < 0 ? -1 : next > now ? next - now : 0;
+}
+
+static void mm_close(struct mm_device *dev, int epfd)
+{
+	epoll_ctl(epfd, EPOLL_CTL_DEL, dev->hidraw, NULL);
+	close(dev->hidraw);
+	dev->hidraw = -1;
+	ioctl(dev->uinput, UI_DEV_DESTROY);
+	close(dev->uinput);
+}
+
+int main(int argc, char **argv)
+{
+	struct epoll_event events[MAX_DEVICES];
+	__u8 report[REPORT_SIZE];
+	int epfd, ii, nr, timeout, ndevices, active = 0;
+
+	if (argc < 2 || argc - 1 > MAX_DEVICES) {
+		fprintf(stderr, "usage: %s /dev/hidrawN ... (up to %d)\n",
+			argv[0], MAX_DEVICES);
+		return 1;
+	}
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0) {
+		perror("epoll_create1");
+		return 1;
+	}
+
+	for (ii = 1; ii < argc; ii++)
+		if (mm_open(&devices[active], argv[ii], epfd) == 0)
+			active++;
+	ndevices = active;
+
+	while (active > 0) {
+		timeout = mm_retry_multitouch(ndevices);
+		nr = epoll_wait(epfd, events, MAX_DEVICES, timeout);
+		if (nr < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("epoll_wait");
+			break;
+		}
+
+		for (ii = 0; ii < nr; ii++) {
+			struct mm_device *dev = events[ii].data.ptr;
+			int batch, size = 0;
+
+			for (batch = 0; batch < REPORT_BATCH; batch++) {
+				size = read(dev->hidraw, report, sizeof(report));
+				if (size <= 0)
+					break;
+				mm_handle_report(dev, report, size);
+			}
+
+			if ((size < 0 && errno != EAGAIN) ||
+			    events[ii].events & (EPOLLHUP | EPOLLERR)) {
+				fprintf(stderr, "%s: device gone\n", dev->path);
+				mm_close(dev, epfd);
+				active--;
+			}
+		}
+	}
+
+	close(epfd);
+	return 0;
+}